@@ -0,0 +1,685 @@
+#pragma once
+
+// Engine-owned board core.
+//
+// Compact bitboard position with copy-make, magic bitboard sliders (PEXT with USE_PEXT)
+// and legal move generation using check and pin masks.
+// Moves are plain libchess `Move`s, so they can be handed to chess_push directly.
+
+#include "chessapi.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_PEXT
+    #include <immintrin.h>
+#endif
+
+
+#define BIT(SQUARE) (1ull << (SQUARE))
+#define SQUARE_OF(BB) __builtin_ctzll(BB)
+
+#define NO_SQUARE 64
+
+#define CASTLE_WHITE_KINGSIDE 0b0001
+#define CASTLE_WHITE_QUEENSIDE 0b0010
+#define CASTLE_BLACK_KINGSIDE 0b0100
+#define CASTLE_BLACK_QUEENSIDE 0b1000
+
+#define RANK_1 0x00000000000000ffull
+#define RANK_8 0xff00000000000000ull
+#define FILE_A 0x0101010101010101ull
+#define FILE_H 0x8080808080808080ull
+
+static_assert(WHITE == 0 && BLACK == 1, "board.h indexes by PlayerColor");
+static_assert(PAWN > 0 && KING < 7, "board.h indexes by PieceType");
+
+
+typedef struct {
+    uint64_t by_color[2];
+    uint64_t by_type[7]; // indexed by PieceType, [0] is unused
+    uint8_t mailbox[64]; // PieceType on every square, 0 if empty
+
+    uint64_t key;      // zobrist key, kept up to date by position_make_move
+    uint64_t pawn_key; // same, but only over the pawns
+
+    uint8_t side;
+    uint8_t castling;
+    uint8_t ep_square; // only set if a pawn can actually capture there
+    uint8_t halfmove;
+} Position;
+
+
+typedef struct {
+    uint64_t mask;
+    uint64_t magic;
+    uint64_t* attacks;
+    int shift;
+} Magic;
+
+static uint64_t knight_attacks[64], king_attacks[64], pawn_attacks[2][64];
+static uint64_t between_bb[64][64], line_bb[64][64];
+
+static Magic rook_magics[64], bishop_magics[64];
+static uint64_t rook_table[102400], bishop_table[5248];
+
+static uint8_t castling_mask[64];
+
+static uint64_t zobrist_pieces[2][7][64], zobrist_castling[16], zobrist_en_passant[8], zobrist_side;
+
+// found offline with a fixed seed, only used by the non-PEXT build
+static const uint64_t rook_magic_numbers[64] = {
+    0x1080004008801020ull, 0x0840092002c03000ull, 0x1900200010400900ull, 0x0880100008000480ull,
+    0x4200100420080200ull, 0x8100020100080400ull, 0x0200040110886200ull, 0x0200008040220411ull,
+    0x0404800084400220ull, 0x0000401000402000ull, 0x0086001081220440ull, 0x0408800800100280ull,
+    0x000a001201040820ull, 0x8848800200840080ull, 0x4001000100040200ull, 0x0442000102105084ull,
+    0x9080010020804100ull, 0x0040404000201009ull, 0x0000808010002009ull, 0x2200090021d00100ull,
+    0x0008008008040080ull, 0x0004004002010040ull, 0x0011040008015042ull, 0x00000a0001768104ull,
+    0x0000800080204009ull, 0x2010004140002001ull, 0x9800200280100080ull, 0x1000100080080080ull,
+    0x0442000a00049020ull, 0x2100040080020080ull, 0x0800120400900148ull, 0x0010040a00128541ull,
+    0x2800804000800030ull, 0x1010002000400041ull, 0x4000200011004100ull, 0x0610008410800800ull,
+    0x0400802402800800ull, 0xc100020080800400ull, 0x0002000802000401ull, 0x0182085882000401ull,
+    0x0220204000808000ull, 0x2860100040024022ull, 0x0001002004110040ull, 0x99101042000a0020ull,
+    0x0004080004008080ull, 0x0010040002008080ull, 0x2012004881020004ull, 0x8300842444820011ull,
+    0x0088403882010200ull, 0x0820400080210100ull, 0x0110910040a00300ull, 0x0801100280080480ull,
+    0x0242009008200600ull, 0x1002000489500200ull, 0x0040800200010080ull, 0x0091800041000080ull,
+    0x0000209300488001ull, 0x04c1002414824001ull, 0x020020000b001041ull, 0x7000100004200901ull,
+    0x8002002004100802ull, 0x30010002084c0007ull, 0x0888221800813004ull, 0x4000002840840112ull,
+};
+static const uint64_t bishop_magic_numbers[64] = {
+    0xa010041108003100ull, 0x006082020a002900ull, 0x6810010619200000ull, 0x08281a0520000408ull,
+    0x0001104001000400ull, 0x0018901008048400ull, 0x00040a0210245280ull, 0x000200210808a402ull,
+    0x9140048410821200ull, 0x0800091010820041ull, 0x20504804832202c0ull, 0x0100091401081000ull,
+    0x8021011140000012ull, 0x0810020804450400ull, 0x208b0542109008a2ull, 0x0080084a08040204ull,
+    0x0040e2a80811244cull, 0x2505022008008108ull, 0x0430220100420040ull, 0x010a040420220040ull,
+    0x1105000290400000ull, 0x0093001200822120ull, 0x4000a62048043004ull, 0x280120048a015004ull,
+    0x006090002a020814ull, 0x44042000240800d0ull, 0x01102800040a4400ull, 0x1004080080220040ull,
+    0x0001001011004024ull, 0x0010044000805040ull, 0x0914041200820100ull, 0x0004821012821480ull,
+    0x0024040500c05021ull, 0x0088611002080200ull, 0x0116080a00040020ull, 0x4000020080080080ull,
+    0x2450450140840040ull, 0x0000880201484100ull, 0x0222020404020092ull, 0x8081110600002e00ull,
+    0x2842101105000801ull, 0x1100809008001025ull, 0x00020202221c0400ull, 0x0422014022009020ull,
+    0x0210046102100c00ull, 0xc004008082029102ull, 0x00aa461801101200ull, 0x0404080080201108ull,
+    0x020542108c205002ull, 0x0410544804100100ull, 0x0040910841100000ull, 0x0400200042021100ull,
+    0x00004204850400c0ull, 0x0200100410a42102ull, 0x1040020801210102ull, 0x0805040410420000ull,
+    0x2884804130100200ull, 0x800c262201242000ull, 0x1058000194108800ull, 0x0014221054420204ull,
+    0x0104000012a02200ull, 0x0200881003300100ull, 0x0140400202840100ull, 0x0402020801010201ull,
+};
+
+
+static inline int pop_square(uint64_t* bb) {
+    int square = SQUARE_OF(*bb);
+    *bb &= *bb - 1;
+    return square;
+}
+
+static inline uint64_t magic_index(const Magic* m, uint64_t occupied) {
+#ifdef USE_PEXT
+    return _pext_u64(occupied, m->mask);
+#else
+    return ((occupied & m->mask) * m->magic) >> m->shift;
+#endif
+}
+
+static inline uint64_t rook_attacks(int square, uint64_t occupied) {
+    return rook_magics[square].attacks[magic_index(&rook_magics[square], occupied)];
+}
+static inline uint64_t bishop_attacks(int square, uint64_t occupied) {
+    return bishop_magics[square].attacks[magic_index(&bishop_magics[square], occupied)];
+}
+
+
+// slow ray walk, only used to fill the tables
+static uint64_t board_slide(int square, uint64_t occupied, const int directions[4][2]) {
+    uint64_t attacks = 0;
+    for (int d = 0; d < 4; d++) {
+        int rank = square / 8 + directions[d][0];
+        int file = square % 8 + directions[d][1];
+        while (rank >= 0 && rank < 8 && file >= 0 && file < 8) {
+            attacks |= BIT(rank * 8 + file);
+            if (occupied & BIT(rank * 8 + file)) {
+                break;
+            }
+            rank += directions[d][0];
+            file += directions[d][1];
+        }
+    }
+    return attacks;
+}
+
+static uint64_t* board_init_magics(
+    Magic magics[64], const uint64_t magic_numbers[64], uint64_t* table, const int directions[4][2]
+) {
+    for (int square = 0; square < 64; square++) {
+        uint64_t edges = ((RANK_1 | RANK_8) & ~(RANK_1 << (square / 8 * 8)))
+                       | ((FILE_A | FILE_H) & ~(FILE_A << (square % 8)));
+
+        Magic* m = &magics[square];
+        m->mask = board_slide(square, 0, directions) & ~edges;
+        m->magic = magic_numbers[square];
+        m->shift = 64 - __builtin_popcountll(m->mask);
+        m->attacks = table;
+
+        // carry-rippler over all subsets of the mask
+        uint64_t occupied = 0;
+        do {
+            m->attacks[magic_index(m, occupied)] = board_slide(square, occupied, directions);
+            occupied = (occupied - m->mask) & m->mask;
+        } while (occupied);
+
+        table += 1ull << __builtin_popcountll(m->mask);
+    }
+    return table;
+}
+
+static uint64_t board_random(void) {
+    // xorshift64*, fixed seed so keys are the same every run
+    static uint64_t state = 0x9e3779b97f4a7c15ull;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+}
+
+static void board_init(void) {
+    static const int rook_directions[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    static const int bishop_directions[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+    static const int knight_jumps[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+
+    for (int square = 0; square < 64; square++) {
+        int rank = square / 8, file = square % 8;
+
+        for (int i = 0; i < 8; i++) {
+            int r = rank + knight_jumps[i][0], f = file + knight_jumps[i][1];
+            if (r >= 0 && r < 8 && f >= 0 && f < 8) {
+                knight_attacks[square] |= BIT(r * 8 + f);
+            }
+        }
+        for (int r = rank - 1; r <= rank + 1; r++) {
+            for (int f = file - 1; f <= file + 1; f++) {
+                if (r >= 0 && r < 8 && f >= 0 && f < 8 && (r != rank || f != file)) {
+                    king_attacks[square] |= BIT(r * 8 + f);
+                }
+            }
+        }
+
+        uint64_t bb = BIT(square);
+        pawn_attacks[WHITE][square] = ((bb & ~FILE_A) << 7 | (bb & ~FILE_H) << 9) & ~RANK_1;
+        pawn_attacks[BLACK][square] = ((bb & ~FILE_A) >> 9 | (bb & ~FILE_H) >> 7) & ~RANK_8;
+
+        castling_mask[square] = 0b1111;
+    }
+
+    board_init_magics(rook_magics, rook_magic_numbers, rook_table, rook_directions);
+    board_init_magics(bishop_magics, bishop_magic_numbers, bishop_table, bishop_directions);
+
+    for (int a = 0; a < 64; a++) {
+        for (int b = 0; b < 64; b++) {
+            if (a == b) {
+                continue;
+            }
+            if (bishop_attacks(a, 0) & BIT(b)) {
+                between_bb[a][b] = bishop_attacks(a, BIT(b)) & bishop_attacks(b, BIT(a));
+                line_bb[a][b] = (bishop_attacks(a, 0) & bishop_attacks(b, 0)) | BIT(a) | BIT(b);
+            }
+            if (rook_attacks(a, 0) & BIT(b)) {
+                between_bb[a][b] = rook_attacks(a, BIT(b)) & rook_attacks(b, BIT(a));
+                line_bb[a][b] = (rook_attacks(a, 0) & rook_attacks(b, 0)) | BIT(a) | BIT(b);
+            }
+        }
+    }
+
+    castling_mask[0] &= ~CASTLE_WHITE_QUEENSIDE;
+    castling_mask[4] &= ~(CASTLE_WHITE_KINGSIDE | CASTLE_WHITE_QUEENSIDE);
+    castling_mask[7] &= ~CASTLE_WHITE_KINGSIDE;
+    castling_mask[56] &= ~CASTLE_BLACK_QUEENSIDE;
+    castling_mask[60] &= ~(CASTLE_BLACK_KINGSIDE | CASTLE_BLACK_QUEENSIDE);
+    castling_mask[63] &= ~CASTLE_BLACK_KINGSIDE;
+
+    for (int color = 0; color < 2; color++) {
+        for (int piece = PAWN; piece <= KING; piece++) {
+            for (int square = 0; square < 64; square++) {
+                zobrist_pieces[color][piece][square] = board_random();
+            }
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        zobrist_castling[i] = board_random();
+    }
+    for (int i = 0; i < 8; i++) {
+        zobrist_en_passant[i] = board_random();
+    }
+    zobrist_side = board_random();
+}
+
+
+#define PIECES(POS, COLOR, PIECE) ((POS)->by_color[COLOR] & (POS)->by_type[PIECE])
+#define OCCUPIED(POS) ((POS)->by_color[WHITE] | (POS)->by_color[BLACK])
+
+static inline bool position_is_attacked(const Position* pos, int square, int by_color, uint64_t occupied) {
+    const uint64_t attackers = pos->by_color[by_color];
+    const uint64_t queens = pos->by_type[QUEEN];
+
+    return (pawn_attacks[by_color ^ 1][square] & pos->by_type[PAWN] & attackers)
+        || (knight_attacks[square] & pos->by_type[KNIGHT] & attackers)
+        || (king_attacks[square] & pos->by_type[KING] & attackers)
+        || (bishop_attacks(square, occupied) & (pos->by_type[BISHOP] | queens) & attackers)
+        || (rook_attacks(square, occupied) & (pos->by_type[ROOK] | queens) & attackers);
+}
+
+static inline uint64_t position_checkers(const Position* pos) {
+    const int king = SQUARE_OF(PIECES(pos, pos->side, KING));
+    const uint64_t occupied = OCCUPIED(pos);
+    const uint64_t queens = pos->by_type[QUEEN];
+
+    return ((pawn_attacks[pos->side][king] & pos->by_type[PAWN])
+            | (knight_attacks[king] & pos->by_type[KNIGHT])
+            | (bishop_attacks(king, occupied) & (pos->by_type[BISHOP] | queens))
+            | (rook_attacks(king, occupied) & (pos->by_type[ROOK] | queens)))
+         & pos->by_color[pos->side ^ 1];
+}
+
+static inline bool position_in_check(const Position* pos) {
+    return position_checkers(pos) != 0;
+}
+
+// Whether the side to move can legally capture en passant on ep_square. Only then does a position
+// carry an ep square, which is all libchess' legal move list reveals to position_from_board.
+static inline bool position_can_capture_en_passant(const Position* pos, int ep_square) {
+    const int us = pos->side, them = us ^ 1;
+    const int king = SQUARE_OF(PIECES(pos, us, KING));
+    const int captured = ep_square ^ 8;
+    const uint64_t attackers = pos->by_color[them] & ~BIT(captured);
+    const uint64_t queens = pos->by_type[QUEEN];
+
+    uint64_t pawns = pawn_attacks[them][ep_square] & PIECES(pos, us, PAWN);
+    while (pawns) {
+        const uint64_t occupied = (OCCUPIED(pos) ^ BIT(pop_square(&pawns)) ^ BIT(captured)) | BIT(ep_square);
+        if (!((pawn_attacks[us][king] & pos->by_type[PAWN] & attackers)
+              || (knight_attacks[king] & pos->by_type[KNIGHT] & attackers)
+              || (bishop_attacks(king, occupied) & (pos->by_type[BISHOP] | queens) & attackers)
+              || (rook_attacks(king, occupied) & (pos->by_type[ROOK] | queens) & attackers))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static inline Move* board_push_move(Move* out, int from, int to, int promotion, bool capture, bool castle) {
+    out->from = BIT(from);
+    out->to = BIT(to);
+    out->promotion = promotion;
+    out->capture = capture;
+    out->castle = castle;
+    return out + 1;
+}
+
+static inline Move* board_push_pawn_moves(Move* out, int from, int to, bool capture) {
+    if (BIT(to) & (RANK_1 | RANK_8)) {
+        out = board_push_move(out, from, to, QUEEN, capture, false);
+        out = board_push_move(out, from, to, ROOK, capture, false);
+        out = board_push_move(out, from, to, BISHOP, capture, false);
+        return board_push_move(out, from, to, KNIGHT, capture, false);
+    }
+    return board_push_move(out, from, to, 0, capture, false);
+}
+
+// Legal moves only. With captures_only, exactly the moves with `capture` set are generated.
+// Returns the number of moves written, the caller provides space for 256.
+static inline int position_generate_moves(const Position* pos, Move* moves, bool captures_only) {
+    const int us = pos->side, them = us ^ 1;
+    const uint64_t ours = pos->by_color[us], theirs = pos->by_color[them];
+    const uint64_t occupied = ours | theirs;
+    const uint64_t queens = pos->by_type[QUEEN];
+    const int king = SQUARE_OF(ours & pos->by_type[KING]);
+    const uint64_t checkers = position_checkers(pos);
+
+    Move* out = moves;
+
+    uint64_t targets = king_attacks[king] & (captures_only ? theirs : ~ours);
+    while (targets) {
+        int to = pop_square(&targets);
+        // the king may not hide behind itself from a slider
+        if (!position_is_attacked(pos, to, them, occupied ^ BIT(king))) {
+            out = board_push_move(out, king, to, 0, BIT(to) & theirs, false);
+        }
+    }
+
+    if (checkers & (checkers - 1)) {
+        return out - moves;
+    }
+
+    const uint64_t check_mask = checkers ? between_bb[king][SQUARE_OF(checkers)] | checkers : ~0ull;
+    const uint64_t allowed = check_mask & (captures_only ? theirs : ~ours);
+
+    uint64_t pinned = 0;
+    uint64_t snipers = ((rook_attacks(king, theirs) & (pos->by_type[ROOK] | queens))
+                        | (bishop_attacks(king, theirs) & (pos->by_type[BISHOP] | queens)))
+                     & theirs;
+    while (snipers) {
+        uint64_t blockers = between_bb[king][pop_square(&snipers)] & occupied;
+        if (!(blockers & (blockers - 1))) {
+            pinned |= blockers & ours;
+        }
+    }
+
+    // pawns
+    const int forward = us == WHITE ? 8 : -8;
+    const uint64_t double_push_rank = us == WHITE ? 0x000000000000ff00ull : 0x00ff000000000000ull;
+
+    uint64_t pawns = PIECES(pos, us, PAWN);
+    while (pawns) {
+        int from = pop_square(&pawns);
+        uint64_t pin_ray = BIT(from) & pinned ? line_bb[king][from] : ~0ull;
+
+        uint64_t captures = pawn_attacks[us][from] & theirs & check_mask & pin_ray;
+        while (captures) {
+            out = board_push_pawn_moves(out, from, pop_square(&captures), true);
+        }
+
+        if (pos->ep_square != NO_SQUARE && (pawn_attacks[us][from] & BIT(pos->ep_square) & pin_ray)) {
+            int captured = pos->ep_square ^ 8;
+            uint64_t after = (occupied ^ BIT(from) ^ BIT(captured)) | BIT(pos->ep_square);
+
+            // also catches the horizontal pin where both pawns leave the rank
+            if ((check_mask & (BIT(pos->ep_square) | BIT(captured)))
+                && !(rook_attacks(king, after) & (pos->by_type[ROOK] | queens) & theirs)
+                && !(bishop_attacks(king, after) & (pos->by_type[BISHOP] | queens) & theirs)) {
+                out = board_push_move(out, from, pos->ep_square, 0, true, false);
+            }
+        }
+
+        if (captures_only || (BIT(from + forward) & occupied)) {
+            continue;
+        }
+        if (BIT(from + forward) & check_mask & pin_ray) {
+            out = board_push_pawn_moves(out, from, from + forward, false);
+        }
+        if ((BIT(from) & double_push_rank) && !(BIT(from + 2 * forward) & occupied)
+            && (BIT(from + 2 * forward) & check_mask & pin_ray)) {
+            out = board_push_move(out, from, from + 2 * forward, 0, false, false);
+        }
+    }
+
+    // pieces
+    uint64_t pieces = ours & ~pos->by_type[PAWN] & ~pos->by_type[KING];
+    while (pieces) {
+        int from = pop_square(&pieces);
+        uint64_t attacks = pos->mailbox[from] == KNIGHT ? knight_attacks[from]
+                         : pos->mailbox[from] == BISHOP ? bishop_attacks(from, occupied)
+                         : pos->mailbox[from] == ROOK   ? rook_attacks(from, occupied)
+                                                        : bishop_attacks(from, occupied) | rook_attacks(from, occupied);
+        attacks &= allowed;
+        if (BIT(from) & pinned) {
+            attacks &= line_bb[king][from];
+        }
+        while (attacks) {
+            int to = pop_square(&attacks);
+            out = board_push_move(out, from, to, 0, BIT(to) & theirs, false);
+        }
+    }
+
+    // castling, the rights guarantee king and rook are still at home
+    if (!captures_only && !checkers) {
+        const int home = us == WHITE ? 4 : 60;
+        const int rights = pos->castling >> (us * 2);
+
+        if ((rights & CASTLE_WHITE_KINGSIDE) && !(occupied & (BIT(home + 1) | BIT(home + 2)))
+            && !position_is_attacked(pos, home + 1, them, occupied) && !position_is_attacked(pos, home + 2, them, occupied)) {
+            out = board_push_move(out, home, home + 2, 0, false, true);
+        }
+        if ((rights & CASTLE_WHITE_QUEENSIDE) && !(occupied & (BIT(home - 1) | BIT(home - 2) | BIT(home - 3)))
+            && !position_is_attacked(pos, home - 1, them, occupied) && !position_is_attacked(pos, home - 2, them, occupied)) {
+            out = board_push_move(out, home, home - 2, 0, false, true);
+        }
+    }
+
+    return out - moves;
+}
+
+
+static inline void position_put_piece(Position* pos, int color, int piece, int square) {
+    pos->by_color[color] |= BIT(square);
+    pos->by_type[piece] |= BIT(square);
+    pos->mailbox[square] = piece;
+    pos->key ^= zobrist_pieces[color][piece][square];
+    if (piece == PAWN) {
+        pos->pawn_key ^= zobrist_pieces[color][PAWN][square];
+    }
+}
+
+static inline void position_remove_piece(Position* pos, int color, int piece, int square) {
+    pos->by_color[color] ^= BIT(square);
+    pos->by_type[piece] ^= BIT(square);
+    pos->mailbox[square] = 0;
+    pos->key ^= zobrist_pieces[color][piece][square];
+    if (piece == PAWN) {
+        pos->pawn_key ^= zobrist_pieces[color][PAWN][square];
+    }
+}
+
+// copy-make: `child` becomes `pos` with `move` applied, `pos` stays untouched
+static inline void position_make_move(const Position* __restrict__ pos, Position* __restrict__ child, Move move) {
+    *child = *pos;
+
+    const int us = pos->side, them = us ^ 1;
+    const int from = SQUARE_OF(move.from), to = SQUARE_OF(move.to);
+    const int piece = pos->mailbox[from], captured = pos->mailbox[to];
+    int ep_square = NO_SQUARE;
+
+    child->halfmove++;
+    child->ep_square = NO_SQUARE;
+    child->key ^= zobrist_side ^ zobrist_castling[pos->castling];
+    if (pos->ep_square != NO_SQUARE) {
+        child->key ^= zobrist_en_passant[pos->ep_square % 8];
+    }
+
+    if (captured) {
+        position_remove_piece(child, them, captured, to);
+        child->halfmove = 0;
+    }
+    position_remove_piece(child, us, piece, from);
+    position_put_piece(child, us, move.promotion ? move.promotion : piece, to);
+
+    if (piece == PAWN) {
+        child->halfmove = 0;
+
+        if (to == pos->ep_square) {
+            position_remove_piece(child, them, PAWN, to ^ 8);
+        }
+        else if ((from ^ to) == 16 && (pawn_attacks[us][(from + to) / 2] & PIECES(pos, them, PAWN))) {
+            ep_square = (from + to) / 2;
+        }
+    }
+    else if (piece == KING && (from - to == 2 || to - from == 2)) {
+        const int rook_from = to > from ? to + 1 : to - 2;
+        const int rook_to = (from + to) / 2;
+        position_remove_piece(child, us, ROOK, rook_from);
+        position_put_piece(child, us, ROOK, rook_to);
+    }
+
+    child->castling &= castling_mask[from] & castling_mask[to];
+    child->key ^= zobrist_castling[child->castling];
+    child->side = them;
+
+    // same rule as position_from_board, so game history and search keys agree
+    if (ep_square != NO_SQUARE && position_can_capture_en_passant(child, ep_square)) {
+        child->ep_square = ep_square;
+        child->key ^= zobrist_en_passant[ep_square % 8];
+    }
+}
+
+
+// from scratch, the search uses the incremental pos->key instead
+static inline uint64_t position_zobrist_key(const Position* pos) {
+    uint64_t key = zobrist_castling[pos->castling];
+
+    for (int color = 0; color < 2; color++) {
+        uint64_t pieces = pos->by_color[color];
+        while (pieces) {
+            int square = pop_square(&pieces);
+            key ^= zobrist_pieces[color][pos->mailbox[square]][square];
+        }
+    }
+    if (pos->ep_square != NO_SQUARE) {
+        key ^= zobrist_en_passant[pos->ep_square % 8];
+    }
+    if (pos->side == BLACK) {
+        key ^= zobrist_side;
+    }
+    return key;
+}
+
+static inline uint64_t position_pawn_key(const Position* pos) {
+    uint64_t key = 0;
+    for (int color = 0; color < 2; color++) {
+        uint64_t pawns = PIECES(pos, color, PAWN);
+        while (pawns) {
+            key ^= zobrist_pieces[color][PAWN][pop_square(&pawns)];
+        }
+    }
+    return key;
+}
+
+// same contract as chess_get_game_state
+static inline GameState position_game_state(const Position* pos) {
+    Move moves[256];
+    if (position_generate_moves(pos, moves, false)) {
+        return GAME_NORMAL;
+    }
+    return position_in_check(pos) ? GAME_CHECKMATE : GAME_STALEMATE;
+}
+
+
+#define STARTPOS "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+// long algebraic like UCI wants it ("e2e4", "e7e8q"), the null move comes out as "0000"
+static inline void board_format_move(Move move, char out[6]) {
+    if (!move.from) {
+        strcpy(out, "0000");
+        return;
+    }
+    int from = SQUARE_OF(move.from), to = SQUARE_OF(move.to);
+    out[0] = 'a' + from % 8;
+    out[1] = '1' + from / 8;
+    out[2] = 'a' + to % 8;
+    out[3] = '1' + to / 8;
+    out[4] = move.promotion ? " pbnrqk"[move.promotion] : '\0';
+    out[5] = '\0';
+}
+
+static inline int board_piece_from_char(char c) {
+    switch (c | 0x20) {
+        case 'p': return PAWN;
+        case 'n': return KNIGHT;
+        case 'b': return BISHOP;
+        case 'r': return ROOK;
+        case 'q': return QUEEN;
+        case 'k': return KING;
+        default: return 0;
+    }
+}
+
+static inline bool position_from_fen(Position* pos, const char* fen) {
+    memset(pos, 0, sizeof *pos);
+    pos->ep_square = NO_SQUARE;
+
+    int square = 56;
+    for (; *fen && *fen != ' '; fen++) {
+        if (*fen == '/') {
+            square -= 16;
+        }
+        else if (*fen >= '1' && *fen <= '8') {
+            square += *fen - '0';
+        }
+        else {
+            int piece = board_piece_from_char(*fen);
+            if (!piece || square < 0 || square > 63) {
+                return false;
+            }
+            position_put_piece(pos, *fen >= 'a' ? BLACK : WHITE, piece, square++);
+        }
+    }
+
+    if (*fen++ != ' ' || (*fen != 'w' && *fen != 'b')) {
+        return false;
+    }
+    pos->side = *fen++ == 'w' ? WHITE : BLACK;
+
+    for (fen += *fen == ' '; *fen && *fen != ' '; fen++) {
+        pos->castling |= *fen == 'K' ? CASTLE_WHITE_KINGSIDE
+                       : *fen == 'Q' ? CASTLE_WHITE_QUEENSIDE
+                       : *fen == 'k' ? CASTLE_BLACK_KINGSIDE
+                       : *fen == 'q' ? CASTLE_BLACK_QUEENSIDE
+                                     : 0;
+    }
+
+    if (*fen == ' ' && fen[1] >= 'a' && fen[1] <= 'h' && fen[2] >= '1' && fen[2] <= '8') {
+        int ep_square = (fen[2] - '1') * 8 + fen[1] - 'a';
+        if (position_can_capture_en_passant(pos, ep_square)) {
+            pos->ep_square = ep_square;
+        }
+        fen += 3;
+    }
+    else if (*fen == ' ') {
+        fen += 2;
+    }
+
+    if (*fen == ' ') {
+        pos->halfmove = atoi(fen + 1);
+    }
+
+    pos->key = position_zobrist_key(pos);
+    pos->pawn_key = position_pawn_key(pos);
+    return PIECES(pos, WHITE, KING) && PIECES(pos, BLACK, KING);
+}
+
+// libchess doesn't expose the en passant square, so it is recovered from its move list
+static inline void position_from_board(Position* pos, Board* board) {
+    memset(pos, 0, sizeof *pos);
+    pos->ep_square = NO_SQUARE;
+
+    for (int color = 0; color < 2; color++) {
+        for (int piece = PAWN; piece <= KING; piece++) {
+            uint64_t pieces = chess_get_bitboard(board, (PlayerColor)color, (PieceType)piece);
+            while (pieces) {
+                position_put_piece(pos, color, piece, pop_square(&pieces));
+            }
+        }
+    }
+
+    pos->side = chess_is_white_turn(board) ? WHITE : BLACK;
+    pos->castling = chess_can_kingside_castle(board, WHITE) * CASTLE_WHITE_KINGSIDE
+                  | chess_can_queenside_castle(board, WHITE) * CASTLE_WHITE_QUEENSIDE
+                  | chess_can_kingside_castle(board, BLACK) * CASTLE_BLACK_KINGSIDE
+                  | chess_can_queenside_castle(board, BLACK) * CASTLE_BLACK_QUEENSIDE;
+
+    Move moves[256];
+    int len_moves = chess_get_legal_moves_inplace(board, moves, 256);
+    for (int i = 0; i < len_moves; i++) {
+        int to = SQUARE_OF(moves[i].to);
+        if (pos->mailbox[SQUARE_OF(moves[i].from)] == PAWN && moves[i].capture && !pos->mailbox[to]) {
+            pos->ep_square = to;
+        }
+    }
+
+    pos->key = position_zobrist_key(pos);
+    pos->pawn_key = position_pawn_key(pos);
+}
+
+
+static inline uint64_t position_perft(const Position* pos, int depth) {
+    Move moves[256];
+    int len_moves = position_generate_moves(pos, moves, false);
+    if (depth <= 1) {
+        return depth == 1 ? len_moves : 1;
+    }
+
+    uint64_t nodes = 0;
+    for (int i = 0; i < len_moves; i++) {
+        Position child;
+        position_make_move(pos, &child, moves[i]);
+        nodes += position_perft(&child, depth - 1);
+    }
+    return nodes;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Evaluation weights in centipawns. train_nn tune_eval fits them to the Stockfish evals in
+// lichess_db_eval_processed.bin and writes this file back out, the engine and the static
+// eval in train_nn both read it.
+
+// material, indexed by PieceType
+#define EVAL_PAWN 100
+#define EVAL_BISHOP 320
+#define EVAL_KNIGHT 300
+#define EVAL_ROOK 500
+#define EVAL_QUEEN 900
+
+// endgame king terms, only when one side is EVAL_MOPUP_MARGIN ahead in material:
+// (EVAL_MOPUP_OFFSET + their king's distance from the centre * EVAL_MOPUP_CENTER
+//  - distance between the kings * EVAL_MOPUP_DISTANCE) * endgame weight / 16
+#define EVAL_MOPUP_MARGIN 220
+#define EVAL_MOPUP_OFFSET 14
+#define EVAL_MOPUP_CENTER 5
+#define EVAL_MOPUP_DISTANCE 1
+
+// pawn structure, passed pawns by rank as seen from the pawn's side
+#define EVAL_ISOLATED_PAWN 15
+#define EVAL_DOUBLED_PAWN 10
+#define EVAL_PASSED_PAWN {0, 5, 10, 20, 35, 60, 100, 0}
+
+// piece-square tables indexed by PieceType and square from the piece's side (a1 is 0),
+// only defined when tune_eval --pst wrote them since they cost a lot of tokens
+// #define EVAL_PST {{...}, ...}
@@ -0,0 +1,228 @@
+// builds a Polyglot-format book (see book.h) from opening lists
+//
+// usage: make_book out.bin [-p plies] input...
+// inputs are either text books with the moves from the start position in SAN
+// ("fen; 1. e4 c5 2. Nf3 d6; score") or EPD files whose positions carry a bm opcode.
+// every line adds one to the weight of each of its moves. EPD lines without bm (like the
+// UHO start positions) carry no moves and are skipped.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "book.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+typedef struct {
+    uint64_t key;
+    uint16_t move;
+} BookMove;
+
+BookMove* book_moves;
+size_t len_book_moves, capacity_book_moves;
+
+void add_book_move(const Position* pos, Move move) {
+    if (len_book_moves == capacity_book_moves) {
+        capacity_book_moves = capacity_book_moves ? capacity_book_moves * 2 : 1 << 16;
+        book_moves = realloc(book_moves, capacity_book_moves * sizeof *book_moves);
+    }
+    book_moves[len_book_moves++] = (BookMove){.key = polyglot_key(pos), .move = book_encode_move(move)};
+}
+
+// finds the legal move a SAN token like "Nbxd7+", "exd8=Q" or "O-O-O" stands for
+bool parse_san(const Position* pos, const char* san, Move* out) {
+    char token[16];
+    size_t len = 0;
+    for (; san[len] && !isspace((unsigned char)san[len]) && san[len] != ';' && len < sizeof token - 1; len++) {
+        token[len] = san[len];
+    }
+    // check, mate and annotation suffixes
+    while (len && strchr("+#!?", token[len - 1])) {
+        len--;
+    }
+    token[len] = '\0';
+
+    Move moves[256];
+    int len_moves = position_generate_moves(pos, moves, false);
+
+    if (!strcmp(token, "O-O") || !strcmp(token, "0-0") || !strcmp(token, "O-O-O") || !strcmp(token, "0-0-0")) {
+        bool kingside = len == 3;
+        for (int i = 0; i < len_moves; i++) {
+            if (moves[i].castle && (moves[i].to > moves[i].from) == kingside) {
+                *out = moves[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int piece = PAWN, promotion = 0;
+    const char* c = token;
+    if (strchr("NBRQK", *c)) {
+        piece = board_piece_from_char(*c++);
+    }
+    // promotion, with or without the '='
+    if (len >= 2 && strchr("NBRQ", token[len - 1])) {
+        promotion = board_piece_from_char(token[len - 1]);
+        len -= token[len - 2] == '=' ? 2 : 1;
+    }
+    if (len < 2 || c > token + len - 2) {
+        return false;
+    }
+
+    const char* destination = token + len - 2;
+    if (destination[0] < 'a' || destination[0] > 'h' || destination[1] < '1' || destination[1] > '8') {
+        return false;
+    }
+    int to = (destination[1] - '1') * 8 + destination[0] - 'a';
+
+    // whatever is left between the piece and the destination disambiguates
+    int from_file = -1, from_rank = -1;
+    for (; c < destination; c++) {
+        if (*c >= 'a' && *c <= 'h') {
+            from_file = *c - 'a';
+        }
+        else if (*c >= '1' && *c <= '8') {
+            from_rank = *c - '1';
+        }
+    }
+
+    int matches = 0;
+    for (int i = 0; i < len_moves; i++) {
+        int from = SQUARE_OF(moves[i].from);
+        if (pos->mailbox[from] == piece && SQUARE_OF(moves[i].to) == to && moves[i].promotion == promotion
+            && !moves[i].castle && (from_file < 0 || from % 8 == from_file)
+            && (from_rank < 0 || from / 8 == from_rank)) {
+            *out = moves[i];
+            matches++;
+        }
+    }
+    return matches == 1;
+}
+
+// plays the SAN moves in line from pos until the end or a ';', adding every one of them
+bool add_san_line(Position pos, const char* line, int max_plies) {
+    for (int ply = 0; ply < max_plies;) {
+        while (isspace((unsigned char)*line)) {
+            line++;
+        }
+        if (!*line || *line == ';') {
+            return true;
+        }
+
+        // move numbers ("1." and "1..."), results, but not castling written with zeroes
+        if ((isdigit((unsigned char)*line) && strncmp(line, "0-0", 3)) || *line == '*') {
+            while (*line && !isspace((unsigned char)*line) && *line != ';') {
+                line++;
+            }
+            continue;
+        }
+
+        Move move;
+        if (!parse_san(&pos, line, &move)) {
+            return false;
+        }
+        add_book_move(&pos, move);
+
+        Position child;
+        position_make_move(&pos, &child, move);
+        pos = child;
+        ply++;
+
+        while (*line && !isspace((unsigned char)*line) && *line != ';') {
+            line++;
+        }
+    }
+    return true;
+}
+
+bool add_line(const char* line, int max_plies) {
+    Position pos;
+
+    // EPD opcodes end in ';' too, so look for them first
+    const char* bm = strstr(line, " bm ");
+    if (bm) {
+        // EPD has no move counters, position_from_fen doesn't need them
+        return position_from_fen(&pos, line) && add_san_line(pos, bm + 4, 1);
+    }
+
+    const char* moves = strchr(line, ';');
+    if (moves) {
+        position_from_fen(&pos, STARTPOS);
+        return add_san_line(pos, moves + 1, max_plies);
+    }
+    return true;
+}
+
+int compare_book_moves(const void* a, const void* b) {
+    const BookMove *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return (int)x->move - (int)y->move;
+}
+
+int main(int argc, char** argv) {
+    int max_plies = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        switch (opt) {
+            case 'p': max_plies = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p plies] out.bin input...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 2 > argc) {
+        fprintf(stderr, "usage: %s [-p plies] out.bin input...\n", argv[0]);
+        return 1;
+    }
+
+    board_init();
+
+    int bad_lines = 0;
+    for (int i = optind + 1; i < argc; i++) {
+        FILE* input = fopen(argv[i], "r");
+        if (!input) {
+            fprintf(stderr, "couldn't open %s\n", argv[i]);
+            return 1;
+        }
+        char line[4096];
+        while (fgets(line, sizeof line, input)) {
+            bad_lines += !add_line(line, max_plies);
+        }
+        fclose(input);
+    }
+
+    qsort(book_moves, len_book_moves, sizeof *book_moves, compare_book_moves);
+
+    FILE* output = fopen(argv[optind], "wb");
+    if (!output) {
+        fprintf(stderr, "couldn't open %s\n", argv[optind]);
+        return 1;
+    }
+
+    // merge the duplicates, the count becomes the weight
+    size_t len_entries = 0;
+    for (size_t i = 0; i < len_book_moves;) {
+        size_t end = i;
+        while (end < len_book_moves && book_moves[end].key == book_moves[i].key && book_moves[end].move == book_moves[i].move) {
+            end++;
+        }
+        BookEntry entry = {
+            .key = BOOK_BE64(book_moves[i].key),
+            .move = BOOK_BE16(book_moves[i].move),
+            .weight = BOOK_BE16((uint16_t)(end - i < 0xFFFF ? end - i : 0xFFFF)),
+            .learn = 0,
+        };
+        fwrite(&entry, sizeof entry, 1, output);
+        len_entries++;
+        i = end;
+    }
+    fclose(output);
+
+    printf("%lu entries from %lu moves, %d lines skipped\n", len_entries, len_book_moves, bad_lines);
+    free(book_moves);
+    return 0;
+}
@@ -0,0 +1,321 @@
+// perft/divide for the engine board and for libchess
+//
+// usage: perft [-t threads] [-H hash_mb] [-b board|libchess|both] [depth fen]
+// without a position it runs the reference suite and checks the leaf counts.
+// the root moves are split over a thread pool, every worker searches on its own clone.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "board.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// https://www.chessprogramming.org/Perft_Results
+const struct {
+    const char* fen;
+    int depth;
+    uint64_t nodes;
+} reference_positions[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 6, 119060324},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 5, 193690690},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 7, 178633661},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5, 15833292},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 5, 89941194},
+    {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 5, 164075551},
+};
+
+typedef enum {
+    BACKEND_BOARD,
+    BACKEND_LIBCHESS,
+} Backend;
+
+const char* backend_names[] = {"board", "libchess"};
+
+// lockless (xor-verified) so the workers can share it without locks.
+// a torn entry fails the check and just counts as a miss.
+typedef struct {
+    uint64_t check;
+    uint64_t data; // nodes << 8 | depth
+} PerftEntry;
+
+PerftEntry* perft_table;
+uint64_t perft_table_mask;
+
+static inline bool perft_table_probe(uint64_t key, int depth, uint64_t* nodes) {
+    if (!perft_table) {
+        return false;
+    }
+    PerftEntry* entry = &perft_table[key & perft_table_mask];
+    uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED);
+    uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    if ((check ^ data) != key || (data & 0xFF) != (uint64_t)depth) {
+        return false;
+    }
+    *nodes = data >> 8;
+    return true;
+}
+
+static inline void perft_table_store(uint64_t key, int depth, uint64_t nodes) {
+    if (!perft_table) {
+        return;
+    }
+    PerftEntry* entry = &perft_table[key & perft_table_mask];
+    uint64_t data = nodes << 8 | depth;
+    __atomic_store_n(&entry->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+uint64_t perft_board(const Position* pos, int depth) {
+    Move moves[256];
+    int len_moves = position_generate_moves(pos, moves, false);
+    if (depth <= 1) {
+        return depth == 1 ? len_moves : 1;
+    }
+
+    uint64_t nodes = 0;
+    if (perft_table_probe(pos->key, depth, &nodes)) {
+        return nodes;
+    }
+
+    for (int i = 0; i < len_moves; i++) {
+        Position child;
+        position_make_move(pos, &child, moves[i]);
+        nodes += perft_board(&child, depth - 1);
+    }
+
+    perft_table_store(pos->key, depth, nodes);
+    return nodes;
+}
+
+uint64_t perft_libchess(Board* board, int depth) {
+    Move moves[256];
+    int len_moves = chess_get_legal_moves_inplace(board, moves, 256);
+    if (depth <= 1) {
+        return depth == 1 ? len_moves : 1;
+    }
+
+    uint64_t nodes = 0;
+    uint64_t key = chess_zobrist_key(board);
+    if (perft_table_probe(key, depth, &nodes)) {
+        return nodes;
+    }
+
+    for (int i = 0; i < len_moves; i++) {
+        chess_make_move(board, moves[i]);
+        nodes += perft_libchess(board, depth - 1);
+        chess_undo_move(board);
+    }
+
+    perft_table_store(key, depth, nodes);
+    return nodes;
+}
+
+typedef struct {
+    Backend backend;
+    const char* fen;
+    int depth;
+
+    Move root_moves[256];
+    uint64_t root_nodes[256];
+    int len_root_moves;
+
+    // index of the next root move nobody has picked up yet
+    int next_root_move;
+} PerftJob;
+
+void* perft_worker(void* arg) {
+    PerftJob* job = arg;
+
+    // every worker builds its own copy of the root so nothing but the hash table is shared
+    Position root;
+    Board* board = NULL;
+    if (job->backend == BACKEND_BOARD) {
+        position_from_fen(&root, job->fen);
+    }
+    else {
+        board = chess_board_from_fen(job->fen);
+    }
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next_root_move, 1, __ATOMIC_RELAXED)) < job->len_root_moves) {
+        if (job->backend == BACKEND_BOARD) {
+            Position child;
+            position_make_move(&root, &child, job->root_moves[i]);
+            job->root_nodes[i] = perft_board(&child, job->depth - 1);
+        }
+        else {
+            chess_make_move(board, job->root_moves[i]);
+            job->root_nodes[i] = perft_libchess(board, job->depth - 1);
+            chess_undo_move(board);
+        }
+    }
+
+    if (board) {
+        chess_free_board(board);
+    }
+    return NULL;
+}
+
+int64_t now_nanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+void print_move(Move move) {
+    int from = SQUARE_OF(move.from), to = SQUARE_OF(move.to);
+    printf("%c%c%c%c", 'a' + from % 8, '1' + from / 8, 'a' + to % 8, '1' + to / 8);
+    if (move.promotion) {
+        putchar(" pbnrqk"[move.promotion]);
+    }
+}
+
+// returns the total leaf count, or 0 if the fen couldn't be parsed
+uint64_t run_perft(Backend backend, const char* fen, int depth, int num_threads, bool divide) {
+    static PerftJob job;
+    job = (PerftJob){.backend = backend, .fen = fen, .depth = depth};
+
+    if (backend == BACKEND_BOARD) {
+        Position root;
+        if (!position_from_fen(&root, fen)) {
+            return 0;
+        }
+        job.len_root_moves = position_generate_moves(&root, job.root_moves, false);
+    }
+    else {
+        Board* board = chess_board_from_fen(fen);
+        if (!board) {
+            return 0;
+        }
+        job.len_root_moves = chess_get_legal_moves_inplace(board, job.root_moves, 256);
+        chess_free_board(board);
+    }
+
+    if (perft_table) {
+        __builtin_memset(perft_table, 0, (perft_table_mask + 1) * sizeof *perft_table);
+    }
+
+    int64_t start = now_nanos();
+
+    uint64_t nodes = 0;
+    if (depth <= 1) {
+        nodes = depth == 1 ? job.len_root_moves : 1;
+        for (int i = 0; i < job.len_root_moves; i++) {
+            job.root_nodes[i] = 1;
+        }
+    }
+    else {
+        pthread_t threads[num_threads];
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, perft_worker, &job);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < job.len_root_moves; i++) {
+            nodes += job.root_nodes[i];
+        }
+    }
+
+    int64_t elapsed = now_nanos() - start;
+
+    if (divide) {
+        for (int i = 0; i < job.len_root_moves; i++) {
+            print_move(job.root_moves[i]);
+            printf(": %lu\n", job.root_nodes[i]);
+        }
+        printf("\n");
+    }
+    printf(
+        "%-8s depth %d: %lu nodes in %.3fs (%.1f Mnps)\n",
+        backend_names[backend],
+        depth,
+        nodes,
+        elapsed / 1e9,
+        nodes * 1e3 / (elapsed + 1)
+    );
+
+    return nodes;
+}
+
+int main(int argc, char** argv) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int hash_mb = 64;
+    bool backends[2] = {true, true};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:H:b:")) != -1) {
+        switch (opt) {
+            case 't': num_threads = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'H': hash_mb = atoi(optarg); break;
+            case 'b':
+                backends[BACKEND_BOARD] = strcmp(optarg, "libchess") != 0;
+                backends[BACKEND_LIBCHESS] = strcmp(optarg, "board") != 0;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-H hash_mb] [-b board|libchess|both] [depth fen]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    board_init();
+
+    if (hash_mb > 0) {
+        // round down to a power of two so the key can be masked
+        uint64_t entries = (uint64_t)hash_mb * 1024 * 1024 / sizeof(PerftEntry);
+        entries = 1ull << (63 - __builtin_clzll(entries));
+        perft_table = malloc(entries * sizeof *perft_table);
+        perft_table_mask = entries - 1;
+    }
+
+    int failures = 0;
+
+    if (optind + 2 <= argc) {
+        // divide: the fen is usually passed unquoted, so glue the remaining args back together
+        char fen[256] = "";
+        for (int i = optind + 1; i < argc; i++) {
+            strncat(fen, argv[i], sizeof fen - strlen(fen) - 2);
+            strcat(fen, " ");
+        }
+
+        uint64_t results[2] = {0};
+        for (int backend = 0; backend < 2; backend++) {
+            if (backends[backend]) {
+                results[backend] = run_perft(backend, fen, atoi(argv[optind]), num_threads, true);
+                failures += !results[backend];
+            }
+        }
+        if (backends[BACKEND_BOARD] && backends[BACKEND_LIBCHESS] && results[BACKEND_BOARD] != results[BACKEND_LIBCHESS]) {
+            printf("backends disagree\n");
+            failures++;
+        }
+    }
+    else {
+        for (size_t i = 0; i < sizeof reference_positions / sizeof *reference_positions; i++) {
+            printf("%s\n", reference_positions[i].fen);
+            for (int backend = 0; backend < 2; backend++) {
+                if (!backends[backend]) {
+                    continue;
+                }
+                uint64_t nodes = run_perft(
+                    backend,
+                    reference_positions[i].fen,
+                    reference_positions[i].depth,
+                    num_threads,
+                    false
+                );
+                if (nodes != reference_positions[i].nodes) {
+                    printf("FAIL: expected %lu\n", reference_positions[i].nodes);
+                    failures++;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    free(perft_table);
+    return failures != 0;
+}
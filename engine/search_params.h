@@ -0,0 +1,31 @@
+#pragma once
+
+// Search constants. resources/spsa.py rewrites the values in place after tuning,
+// the rest of this file is left alone.
+
+// late move reductions: (len_moves * LMR_MOVES + depthleft * LMR_DEPTH) / 1000
+#define LMR_MOVES 93
+#define LMR_DEPTH 144
+
+// initial half-width of the root window and how much it grows after each fail
+#define ASPIRATION_WINDOW 25
+#define ASPIRATION_WIDENING 4
+
+// cutoff bonus HISTORY_BONUS_DEPTH * depthleft - HISTORY_BONUS_OFFSET,
+// the quiet moves searched before it get bonus / -HISTORY_MALUS_DIVISOR
+#define HISTORY_BONUS_DEPTH 300
+#define HISTORY_BONUS_OFFSET 250
+#define HISTORY_MALUS_DIVISOR 8
+// gravity, has to stay below SCORE_TIER_CAPTURE so history never outranks a capture
+#define MAX_HISTORY 1000000
+
+// name, min, max. -DTUNE turns each of these into a variable setoption can change
+#define SEARCH_PARAMS(X)                  \
+    X(LMR_MOVES, 0, 300)                  \
+    X(LMR_DEPTH, 0, 500)                  \
+    X(ASPIRATION_WINDOW, 5, 200)          \
+    X(ASPIRATION_WIDENING, 2, 16)         \
+    X(HISTORY_BONUS_DEPTH, 50, 1000)      \
+    X(HISTORY_BONUS_OFFSET, 0, 1000)      \
+    X(HISTORY_MALUS_DIVISOR, 1, 64)       \
+    X(MAX_HISTORY, 100000, 1000000)
@@ -1,13 +1,49 @@
+#ifndef MINIMIZE
+    // mmap for the book, nanosleep for the trace flusher
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "chessapi.h"
+#include "board.h"
+#include "eval_params.h"
+#include "search_params.h"
 #include "stdlib.h"
 
 #ifndef MINIMIZE
     #define STATS
+    #define BENCH
+    #define BOOK
+    #include "book.h"
     #include "stdio.h"
+    #include "string.h"
+    #include "time.h"
 
     #define STATIC_ASSERTS
 #endif
 
+// build with -DSYZYGY against Fathom (https://github.com/jdart1/Fathom), which maps the
+// tablebase files and decodes them. THERA_SYZYGY points at the directories.
+#ifdef SYZYGY
+    #include "tbprobe.h"
+#endif
+
+// build with -DUCI for a native UCI front-end instead of the tournament's chessapi loop,
+// -DPONDER to keep searching on the opponent's time
+#if defined(UCI) || defined(PONDER)
+    #include <pthread.h>
+    #define STOP_FLAG
+#endif
+
+
+// build with -DUCI -DTUNE to make the search constants settable through setoption
+#ifdef TUNE
+    #define DECLARE_PARAM(NAME, MIN, MAX) int tune_##NAME = NAME;
+SEARCH_PARAMS(DECLARE_PARAM)
+    #define PARAM(NAME) tune_##NAME
+#else
+    #define PARAM(NAME) NAME
+#endif
+
 
 #undef INFINITY
 #define INFINITY 10000000
@@ -48,22 +84,76 @@ static_assert(TRANSPOSITION_SIZE == (1ul << 26));
 
 Board* board;
 
-struct {
+#define MAX_PLY 512
+
+// copy-make stack, pos points at the node currently being searched
+Position position_stack[MAX_PLY], *pos;
+
+// the child key is known right after making the move, so start pulling in its TT entry
+// while the move loop still has work to do before recursing
+#define MAKE_MOVE(MOVE)                                      \
+    position_make_move(pos, pos + 1, MOVE), pos++,           \
+        __builtin_prefetch(&ENTRY),                          \
+        repetition_ring[RING_INDEX(PLY)] = pos->key;        \
+    TRACE_MOVE(MOVE)
+#define UNDO_MOVE pos--;
+
+#define PLY (pos - position_stack)
+
+
+// keys of the game so far followed by the current search path, indexed by game ply.
+// Large enough to hold the 100 plies the halfmove clock allows plus a full search path.
+#define REPETITION_RING_SIZE 1024
+#define RING_INDEX(SEARCH_PLY) ((game_ply + (SEARCH_PLY)) & (REPETITION_RING_SIZE - 1))
+
+uint64_t repetition_ring[REPETITION_RING_SIZE];
+
+// game ply of the root and the position right after our last move,
+// so the next root can be matched against the opponent's replies
+int game_ply;
+Position game_position;
+
+#ifdef STATIC_ASSERTS
+static_assert(REPETITION_RING_SIZE >= MAX_PLY + 100 && !(REPETITION_RING_SIZE & (REPETITION_RING_SIZE - 1)));
+#endif
+
+// a single earlier occurrence is enough to score a draw, continuing the cycle can't gain anything.
+// Only positions since the last irreversible move can repeat.
+bool is_repetition() {
+    // a halfmove clock from a FEN can reach back past the first recorded position
+    for (int i = 4; i <= MIN(pos->halfmove, game_ply + PLY); i += 2) {
+        if (repetition_ring[RING_INDEX(PLY - i)] == pos->key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Compile-time stats policy: the counters always exist, but without STATS every update
+// is a `+= 0` or sits behind a constant false branch, so the compiler drops it.
 #ifdef STATS
-    struct {
-        uint64_t num_nodes;
-    } stats;
+constexpr bool collect_stats = true;
+#else
+constexpr bool collect_stats = false;
 #endif
-    uint64_t hash;
+
+// qsearch results are stored at depth 0, main search entries are always deeper
+#define QSEARCH_DEPTH 0
+#define NO_STATIC_EVAL -32768
+
+struct {
+    uint32_t hash; // upper half of the key, the lower bits already picked the slot
     int eval;
+    int16_t static_eval; // side to move relative, only qsearch fills it in
     uint8_t type, depth, bestMove_from, bestMove_to;
 } transposition_table[TRANSPOSITION_SIZE];
 
+// nodes searched below every entry, kept out of the TT itself so stats builds search the same table
+uint64_t tt_subtree_nodes[collect_stats ? TRANSPOSITION_SIZE : 1];
+
 #ifdef STATIC_ASSERTS
-constexpr size_t tt_size = sizeof transposition_table;
-constexpr size_t stat_size = sizeof transposition_table[0].stats * TRANSPOSITION_SIZE;
-constexpr size_t optimized_tt_size = tt_size - stat_size;
-static_assert(optimized_tt_size <= 1024 * 1024 * 1024, "Transposition table is too big");
+static_assert(sizeof transposition_table <= 1024 * 1024 * 1024, "Transposition table is too big");
+static_assert(sizeof *transposition_table == 16, "Transposition table entries grew");
 #endif
 
 
@@ -80,31 +170,148 @@ int history_table[8212]; // [2][64][64]
 static_assert(sizeof(history_table) / sizeof(history_table[0]) == HISTORY_TABLE_SIZE + JUMP_BUFFER_SIZE);
 #endif
 
-#define INDEX_HISTORY_TABLE(FROM, TO) \
-    history_table[chess_is_white_turn(board) * 4096 + chess_get_index_from_bitboard(FROM) * 64 + chess_get_index_from_bitboard(TO)]
+#define INDEX_HISTORY_TABLE(FROM, TO) history_table[pos->side * 4096 + SQUARE_OF(FROM) * 64 + SQUARE_OF(TO)]
 
 
-#ifdef STATS
+// always counted, bench and the node counts in the info lines rely on it
+uint64_t nodes;
+
 uint64_t hashes_used;
 
-uint64_t searched_nodes;
-uint64_t transposition_hits;
-uint64_t cached_nodes;
-uint64_t transposition_overwrites;
-uint64_t new_hashes;
-uint64_t researches;
-uint64_t first_move_cuts;
-uint64_t first_move_non_cuts;
-uint64_t negascout_hits;
-uint64_t negascout_misses;
-uint64_t lmr_hits;
-uint64_t lmr_misses;
+#define SEARCH_THREADS 1
+
+#define TELEMETRY_DEPTHS 16
+#define TELEMETRY_MOVE_INDICES 16
+#define TELEMETRY_REDUCTIONS 8
+#define TELEMETRY_QSEARCH_DEPTHS 16
+
+// clamps into the last bucket so the histograms have a fixed size
+#define TELEMETRY_BUCKET(X, BUCKETS) ((X) < (BUCKETS) - 1 ? (X) : (BUCKETS) - 1)
+
+enum {
+    TT_PROBE_MISS,    // different position or empty
+    TT_PROBE_SHALLOW, // right position, not deep enough
+    TT_PROBE_BOUND,   // deep enough, but the bound doesn't cut
+    TT_PROBE_CUTOFF,
+    TT_PROBE_OUTCOMES,
+};
+
+// one per search thread. the alignment pads every slot to whole cache lines
+// so threads never write to the same one. only uint64_t members, telemetry_total() relies on it.
+typedef struct {
+    alignas(64) uint64_t searched_nodes;
+    uint64_t transposition_hits;
+    uint64_t cached_nodes;
+    uint64_t transposition_overwrites;
+    uint64_t new_hashes;
+    uint64_t researches;
+    uint64_t first_move_cuts;
+    uint64_t first_move_non_cuts;
+    uint64_t negascout_hits;
+    uint64_t negascout_misses;
+    uint64_t lmr_hits;
+    uint64_t lmr_misses;
+    uint64_t qsearch_tt_cutoffs;
+    uint64_t static_eval_hits;
+    uint64_t eval_cache_probes;
+    uint64_t eval_cache_hits;
+    uint64_t pawn_hash_probes;
+    uint64_t pawn_hash_hits;
+    uint64_t tb_hits;
+
+    // histograms, bucketed by remaining depth where that makes sense
+    uint64_t tt_probes[TELEMETRY_DEPTHS][TT_PROBE_OUTCOMES];
+    uint64_t cutoff_move_index[TELEMETRY_DEPTHS][TELEMETRY_MOVE_INDICES];
+    uint64_t lmr_reductions[TELEMETRY_DEPTHS][TELEMETRY_REDUCTIONS];
+    uint64_t qsearch_depth[TELEMETRY_QSEARCH_DEPTHS];
+} Telemetry;
+
+Telemetry telemetry[SEARCH_THREADS];
+thread_local Telemetry* thread_telemetry = telemetry;
+
+// ply at which the current qsearch tree started, only tracked for the qsearch_depth histogram
+thread_local int qsearch_root_ply;
+
+#define STAT(FIELD) thread_telemetry->FIELD
+
+#define TT_PROBE_OUTCOME                                 \
+    (ENTRY.hash != TT_KEY       ? TT_PROBE_MISS    \
+     : ENTRY.depth < depthleft ? TT_PROBE_SHALLOW \
+                               : TT_PROBE_BOUND)
+
+// build with -DTRACE and set THERA_TRACE to a path to record the search tree.
+// without TRACE every hook below expands to nothing.
+#ifdef TRACE
+    #include "trace.h"
+
+TraceRing trace_rings[SEARCH_THREADS];
+thread_local TraceRing* thread_trace_ring = trace_rings;
+TraceWriter trace_writer;
+bool tracing;
+
+// records are filled in while the node is searched and pushed once it returns
+thread_local TraceRecord trace_stack[MAX_PLY];
+
+    #define TRACE_NODE trace_stack[PLY]
+
+void trace_move(Move move) {
+    TRACE_NODE.from = SQUARE_OF(move.from);
+    TRACE_NODE.to = SQUARE_OF(move.to);
+}
+
+void trace_enter(int depth, int alpha, int beta) {
+    TraceRecord* record = &TRACE_NODE;
+    *record = (TraceRecord){
+        .ply = (uint16_t)PLY,
+        .from = record->from,
+        .to = record->to,
+        .depth = (int16_t)depth,
+        .alpha = alpha,
+        .beta = beta,
+    };
+}
+
+int trace_exit(TraceKind kind, int score) {
+    if (tracing) {
+        TRACE_NODE.kind = kind;
+        TRACE_NODE.score = score;
+        trace_push(thread_trace_ring, &TRACE_NODE);
+    }
+    return score;
+}
+
+void trace_iteration(int depth) {
+    if (tracing) {
+        trace_push(thread_trace_ring, &(TraceRecord){.depth = (int16_t)depth, .kind = TRACE_KIND_ITERATION});
+    }
+}
+
+void trace_finish() {
+    if (tracing) {
+        trace_stop(&trace_writer);
+    }
+}
+
+    #define TRACE_MOVE(MOVE) trace_move(MOVE);
+    #define TRACE_ENTER(DEPTH, ALPHA, BETA) trace_enter(DEPTH, ALPHA, BETA);
+    #define TRACE_EXIT(KIND, SCORE) trace_exit(KIND, SCORE)
+    #define TRACE_ITERATION(DEPTH) trace_iteration(DEPTH);
+    #define TRACE_SET(FIELD, VALUE) TRACE_NODE.FIELD = VALUE;
+    // counts on the parent, so it only works between MAKE_MOVE and UNDO_MOVE
+    #define TRACE_COUNT(FIELD) trace_stack[PLY - 1].FIELD += trace_stack[PLY - 1].FIELD != UINT8_MAX;
+#else
+    #define TRACE_MOVE(MOVE)
+    #define TRACE_ENTER(DEPTH, ALPHA, BETA)
+    #define TRACE_EXIT(KIND, SCORE) SCORE
+    #define TRACE_ITERATION(DEPTH)
+    #define TRACE_SET(FIELD, VALUE)
+    #define TRACE_COUNT(FIELD)
 #endif
 
 #define MAX_MOVES 256
 #define FETCH_MOVES        \
     Move moves[MAX_MOVES]; \
-    int len_moves = chess_get_legal_moves_inplace(board, moves, MAX_MOVES);
+    int len_moves = position_generate_moves(pos, moves, false);
 
 #define SORT_MOVES qsort(moves, len_moves, sizeof *moves, compareMoves);
 
@@ -131,17 +338,20 @@ uint64_t lmr_misses;
 // midgame fail: r5k1/p6p/6p1/2Qb1r2/P6K/8/RP5P/6R1 w - - 0 33
 // prevent promotion: 8/3K4/4P3/8/8/8/6k1/7q w - - 0 1
 
-#define MATERIAL_OF(COLOR)                                                   \
-    +stdc_count_ones_ul(chess_get_bitboard(board, COLOR, PAWN)) * 100        \
-        + stdc_count_ones_ul(chess_get_bitboard(board, COLOR, KNIGHT)) * 300 \
-        + stdc_count_ones_ul(chess_get_bitboard(board, COLOR, BISHOP)) * 320 \
-        + stdc_count_ones_ul(chess_get_bitboard(board, COLOR, ROOK)) * 500   \
-        + stdc_count_ones_ul(chess_get_bitboard(board, COLOR, QUEEN)) * 900
+#define MATERIAL_OF(COLOR)                                             \
+    +stdc_count_ones_ul(PIECES(pos, COLOR, PAWN)) * EVAL_PAWN          \
+        + stdc_count_ones_ul(PIECES(pos, COLOR, KNIGHT)) * EVAL_KNIGHT \
+        + stdc_count_ones_ul(PIECES(pos, COLOR, BISHOP)) * EVAL_BISHOP \
+        + stdc_count_ones_ul(PIECES(pos, COLOR, ROOK)) * EVAL_ROOK     \
+        + stdc_count_ones_ul(PIECES(pos, COLOR, QUEEN)) * EVAL_QUEEN
+
+// knights, bishops, rooks, queens and the king
+#define GET_ENDGAME_WEIGHT(COLOR) pos->by_color[COLOR] & ~pos->by_type[PAWN]
 
-#define GET_ENDGAME_WEIGHT(COLOR)                                                          \
-    chess_get_bitboard(board, COLOR, KNIGHT) | chess_get_bitboard(board, COLOR, BISHOP)    \
-        | chess_get_bitboard(board, COLOR, ROOK) | chess_get_bitboard(board, COLOR, QUEEN) \
-        | chess_get_bitboard(board, COLOR, KING)
+#ifdef EVAL_PST
+// indexed by PieceType, [0] is unused
+const int eval_pst[7][64] = EVAL_PST;
+#endif
 
 int static_eval_me(PlayerColor color) {
 #ifdef STATIC_ASSERTS
@@ -153,18 +363,30 @@ int static_eval_me(PlayerColor color) {
 
     int material = MATERIAL_OF(color);
 
+#ifdef EVAL_PST
+    // kept out of the mop-up condition below, that one only compares material
+    int placement = 0;
+    for (int piece = PAWN; piece <= KING; piece++) {
+        uint64_t pieces = PIECES(pos, color, piece);
+        while (pieces) {
+            // flipped vertically for black
+            placement += eval_pst[piece][pop_square(&pieces) ^ (color == WHITE ? 0 : 56)];
+        }
+    }
+#endif
+
     float endgame_weight = 16.0f;
-    int king = chess_get_index_from_bitboard(chess_get_bitboard(board, color, KING));
+    int king = SQUARE_OF(PIECES(pos, color, KING));
     endgame_weight -= stdc_count_ones_ul(GET_ENDGAME_WEIGHT(color));
 
     color ^= 1;
 
-    int king2 = chess_get_index_from_bitboard(chess_get_bitboard(board, color, KING));
+    int king2 = SQUARE_OF(PIECES(pos, color, KING));
     endgame_weight -= stdc_count_ones_ul(GET_ENDGAME_WEIGHT(color));
 
 
     // color is inverted already
-    if (material > 220 /* there's a plus in the macro */ MATERIAL_OF(color)) {
+    if (material > EVAL_MOPUP_MARGIN /* there's a plus in the macro */ MATERIAL_OF(color)) {
 #define king2_file king2 % 8
 #define king2_rank king2 / 8
 #define king1_file king % 8
@@ -184,11 +406,14 @@ int static_eval_me(PlayerColor color) {
         */
 
 
-        material += (14 + (__builtin_fabsf(king2_file - 3.5f) + __builtin_fabsf(king2_rank - 3.5f)) * 5.0f
-                     - __builtin_abs(king1_file - king2_file) - __builtin_abs(king1_rank - king2_rank))
+        material += (EVAL_MOPUP_OFFSET + (__builtin_fabsf(king2_file - 3.5f) + __builtin_fabsf(king2_rank - 3.5f)) * EVAL_MOPUP_CENTER
+                     - (__builtin_abs(king1_file - king2_file) + __builtin_abs(king1_rank - king2_rank)) * EVAL_MOPUP_DISTANCE)
                   * endgame_weight / 16.0f;
     }
 
+#ifdef EVAL_PST
+    material += placement;
+#endif
     return material;
 }
 
@@ -202,13 +427,138 @@ int static_eval() {
         return 0;
     }
 
-    return (chess_is_white_turn(board) ? 1.0f : -1.0f) * (static_eval_me(WHITE) - static_eval_me(BLACK));
+    return (pos->side == WHITE ? 1.0f : -1.0f) * (static_eval_me(WHITE) - static_eval_me(BLACK));
 }
 */
 
 
-#define HASH chess_zobrist_key(board)
+#define HASH pos->key
 #define ENTRY transposition_table[HASH % TRANSPOSITION_SIZE]
+#define TT_KEY (uint32_t)(HASH >> 32)
+
+// both direct-mapped and always replaced. a position without pawns has pawn key 0,
+// which the zeroed table already answers correctly with 0
+#define PAWN_HASH_SIZE 0b10000000000000000
+#define EVAL_CACHE_SIZE 0b10000000000000000
+
+struct {
+    uint64_t key;
+    int score; // white relative
+} pawn_hash[PAWN_HASH_SIZE];
+
+struct {
+    uint64_t key;
+    int eval; // side to move relative
+} eval_cache[EVAL_CACHE_SIZE];
+
+// indexed by rank as seen from the pawn's side
+const int passed_pawn_bonus[8] = EVAL_PASSED_PAWN;
+
+int pawn_structure_eval() {
+    STAT(pawn_hash_probes) += collect_stats;
+    if (pawn_hash[pos->pawn_key % PAWN_HASH_SIZE].key == pos->pawn_key) {
+        STAT(pawn_hash_hits) += collect_stats;
+        return pawn_hash[pos->pawn_key % PAWN_HASH_SIZE].score;
+    }
+
+    int score = 0;
+    for (int color = WHITE; color <= BLACK; color++) {
+        uint64_t pawns = PIECES(pos, color, PAWN), their_pawns = PIECES(pos, color ^ 1, PAWN);
+        int color_score = 0;
+
+        uint64_t remaining = pawns;
+        while (remaining) {
+            int square = pop_square(&remaining), rank = square / 8;
+            uint64_t file = FILE_A << square % 8;
+            uint64_t neighbours = (file << 1 & ~FILE_A) | (file >> 1 & ~FILE_H);
+            // every square in front of the pawn, from its side's point of view
+            uint64_t ahead = color == WHITE ? ~0ull << (rank * 8 + 8) : (1ull << rank * 8) - 1;
+
+            color_score -= pawns & neighbours ? 0 : EVAL_ISOLATED_PAWN;          // isolated
+            color_score -= pawns & file & ~BIT(square) ? EVAL_DOUBLED_PAWN : 0; // doubled
+            color_score += their_pawns & (file | neighbours) & ahead ? 0 : passed_pawn_bonus[color == WHITE ? rank : 7 - rank];
+        }
+        score += color == WHITE ? color_score : -color_score;
+    }
+
+    pawn_hash[pos->pawn_key % PAWN_HASH_SIZE].key = pos->pawn_key;
+    pawn_hash[pos->pawn_key % PAWN_HASH_SIZE].score = score;
+    return score;
+}
+
+// side to move relative
+int evaluate() {
+    STAT(eval_cache_probes) += collect_stats;
+    if (eval_cache[HASH % EVAL_CACHE_SIZE].key == HASH) {
+        STAT(eval_cache_hits) += collect_stats;
+        return eval_cache[HASH % EVAL_CACHE_SIZE].eval;
+    }
+
+    int eval = static_eval_me(WHITE) - static_eval_me(BLACK) + pawn_structure_eval();
+    eval *= pos->side == WHITE ? 1 : NEGATIVE_ONE;
+
+    eval_cache[HASH % EVAL_CACHE_SIZE].key = HASH;
+    eval_cache[HASH % EVAL_CACHE_SIZE].eval = eval;
+    return eval;
+}
+
+// being mated at ply n scores -INFINITY + n, so shorter mates score higher.
+// the TT holds mate scores relative to the node instead of the root, otherwise they'd be wrong
+// when the position comes up again at a different ply.
+#define MATE_THRESHOLD (INFINITY - MAX_PLY)
+#define IS_MATE(SCORE) (__builtin_abs(SCORE) >= MATE_THRESHOLD)
+#define MATED_SCORE ((int)PLY - INFINITY)
+#ifdef SYZYGY
+    // tablebase scores sit right below the mates and count plies from the root the same way
+    #define IS_PLY_RELATIVE(SCORE) (__builtin_abs(SCORE) >= MATE_THRESHOLD - 1 - MAX_PLY)
+#else
+    #define IS_PLY_RELATIVE(SCORE) IS_MATE(SCORE)
+#endif
+#define SCORE_TO_TT(SCORE) (IS_PLY_RELATIVE(SCORE) ? (SCORE) + ((SCORE) > 0 ? (int)PLY : -(int)PLY) : (SCORE))
+#define SCORE_FROM_TT(SCORE) (IS_PLY_RELATIVE(SCORE) ? (SCORE) - ((SCORE) > 0 ? (int)PLY : -(int)PLY) : (SCORE))
+#define TT_EVAL SCORE_FROM_TT(ENTRY.eval)
+
+#ifdef SYZYGY
+// tablebase wins rank below every real mate, faster conversions first. TB_WIN_SCORE - ply
+// stays within IS_PLY_RELATIVE, so the TT moves them with the ply like mates
+    #define TB_WIN_SCORE (MATE_THRESHOLD - 1)
+
+// largest piece count worth probing, 0 until tablebases are loaded
+unsigned tb_pieces;
+
+// the largest tables found on disk and the cap from SyzygyProbeLimit or THERA_SYZYGY_PIECES,
+// kept apart so the path and the limit can be set in either order
+unsigned tb_largest, tb_probe_limit = 7;
+    #define TB_UPDATE_PIECES tb_pieces = tb_probe_limit < tb_largest ? tb_probe_limit : tb_largest;
+
+    #define TB_POSITION                                                                          \
+        pos->by_color[WHITE], pos->by_color[BLACK], pos->by_type[KING], pos->by_type[QUEEN],      \
+            pos->by_type[ROOK], pos->by_type[BISHOP], pos->by_type[KNIGHT], pos->by_type[PAWN]
+    #define TB_EP_SQUARE (pos->ep_square == NO_SQUARE ? 0 : pos->ep_square)
+    #define TB_PROBEABLE (!pos->castling && (unsigned)__builtin_popcountll(OCCUPIED(pos)) <= tb_pieces)
+
+// DTZ-optimal move for the root, so won endgames are converted within the 50 move rule
+bool tb_root_move(Move* out) {
+    unsigned result = tb_probe_root(TB_POSITION, pos->halfmove, 0, TB_EP_SQUARE, pos->side == WHITE, NULL);
+    if (result == TB_RESULT_FAILED || result == TB_RESULT_CHECKMATE || result == TB_RESULT_STALEMATE) {
+        return false;
+    }
+
+    // indexed by Fathom's TB_PROMOTES_*
+    static const int promotions[5] = {0, QUEEN, ROOK, BISHOP, KNIGHT};
+
+    Move moves[MAX_MOVES];
+    int len_moves = position_generate_moves(pos, moves, false);
+    ITERATE_MOVES {
+        if (SQUARE_OF(moves[i].from) == TB_GET_FROM(result) && SQUARE_OF(moves[i].to) == TB_GET_TO(result)
+            && moves[i].promotion == promotions[TB_GET_PROMOTES(result)]) {
+            *out = moves[i];
+            return true;
+        }
+    }
+    return false;
+}
+#endif
 
 
 int scoreMove(Move* move) {
@@ -217,12 +567,11 @@ int scoreMove(Move* move) {
 #define SCORE_TIER_PV          10000000
 #define SCORE_TIER_CAPTURE      1000000
 #define SCORE_TIER_PROMOTION      50000
-#define MAX_HISTORY             1000000
     // clang-format on
 
     return move->from == 1UL << ENTRY.bestMove_from && move->to == 1UL << ENTRY.bestMove_to ? SCORE_TIER_PV
-         : move->capture ? SCORE_TIER_CAPTURE + 10 * chess_get_piece_from_bitboard(board, move->to)
-                               - chess_get_piece_from_bitboard(board, move->from)
+         : move->capture ? SCORE_TIER_CAPTURE + 10 * pos->mailbox[SQUARE_OF(move->to)]
+                               - pos->mailbox[SQUARE_OF(move->from)]
          : move->promotion ? SCORE_TIER_PROMOTION + move->promotion
                            : INDEX_HISTORY_TABLE(move->from, move->to);
 }
@@ -237,186 +586,461 @@ int compareMoves(const void* a, const void* b) {
 
 #define max_best_value_and(X) MAX(bestValue, X)
 
+#define ENTRY_NODES tt_subtree_nodes[collect_stats * (HASH % TRANSPOSITION_SIZE)]
 
-int alphaBeta(int depthleft, int alpha, int beta) {
-    if ((int64_t)chess_get_elapsed_time_millis() >= MAX((int64_t)chess_get_time_millis() / 40, 1)) {
-        __builtin_longjmp(history_table + JUMP_BUFFER_OFFSET, 1);
+// 0 means no limit, which bench relies on since there is no libchess clock to ask
+int64_t time_limit_millis;
+
+#ifndef MINIMIZE
+int64_t now_millis() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+#endif
+
+#ifdef STOP_FLAG
+// set by another thread (stop, quit, the opponent's move arriving), or by the search itself once
+// a limit is hit. The search then unwinds by returning, so nothing it computes afterwards can be trusted.
+bool stop_search;
+uint64_t node_limit; // 0 means no limit
+int64_t search_start_millis;
+int64_t uci_time_left; // own clock from go wtime/btime, only for the stats
+
+static inline bool search_stopped() {
+    // the flag is checked on every node, the clock only every few hundred.
+    // ponderhit changes the limit mid-search
+    int64_t limit = __atomic_load_n(&time_limit_millis, __ATOMIC_RELAXED);
+    if ((node_limit && nodes >= node_limit)
+        || (limit && !(nodes & 255) && now_millis() - __atomic_load_n(&search_start_millis, __ATOMIC_RELAXED) >= limit)) {
+        __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
     }
+    return __atomic_load_n(&stop_search, __ATOMIC_RELAXED);
+}
 
-#ifdef STATS
-    ++searched_nodes;
-    uint64_t old_searched_nodes = searched_nodes;
-    uint64_t old_cached_nodes = cached_nodes;
+    #define SEARCH_TIMEOUT      \
+        if (search_stopped()) { \
+            return 0;           \
+        }
+    // right after a child returns, so its garbage score never reaches the TT, the history or the root
+    #define SEARCH_ABORTED(...) \
+        if (__atomic_load_n(&stop_search, __ATOMIC_RELAXED)) { __VA_ARGS__ }
+    #define ELAPSED_MILLIS (now_millis() - search_start_millis)
+#else
+    #define SEARCH_TIMEOUT                                                                            \
+        if (time_limit_millis && (int64_t)chess_get_elapsed_time_millis() >= time_limit_millis) {    \
+            __builtin_longjmp(history_table + JUMP_BUFFER_OFFSET, 1);                                \
+        }
+    // the longjmp never returns into the search
+    #define SEARCH_ABORTED(...)
+    #define ELAPSED_MILLIS ((int64_t)chess_get_elapsed_time_millis())
 #endif
 
+#ifdef UCI
+    #define TIME_LEFT_MILLIS uci_time_left
+#else
+    #define TIME_LEFT_MILLIS ((int64_t)chess_get_time_millis())
+#endif
 
-#define is_not_quiescence depthleft > 0
+#define NULL_WINDOW -alpha - 1, -alpha
+#define NORMAL_WINDOW -beta, -alpha
 
 
-#define INFINITY_OVER_TWO 5000000
+// Node types are only ever passed as constants, so every variant of search() below is
+// compiled separately with its node type checks folded away.
+#define NODE_PV 0
+#define NODE_NON_PV 1
 
-    // #define STATE_RETVALUE(X) (X == GAME_CHECKMATE) * NEGATIVE_INFINITY
-#define STATE_RETVALUE(X) X* INFINITY_OVER_TWO - INFINITY_OVER_TWO
+int pvSearch(int depthleft, int alpha, int beta);
+int nonPvSearch(int depthleft, int alpha, int beta);
+int quiescence(int alpha, int beta);
 
-#ifdef STATIC_ASSERTS
-    static_assert(INFINITY / 2 == INFINITY_OVER_TWO);
+static inline __attribute__((always_inline)) int alphaBeta(const int node_type, int depthleft, int alpha, int beta) {
+    // qsearch only ever recurses into itself, so this is always the main search handing over
+    if (collect_stats && depthleft <= 0) {
+        qsearch_root_ply = PLY;
+    }
+    return depthleft <= 0         ? quiescence(alpha, beta)
+         : node_type == NODE_PV ? pvSearch(depthleft, alpha, beta)
+                                : nonPvSearch(depthleft, alpha, beta);
+}
 
-    static_assert(GAME_STALEMATE != 0);
-    static_assert(GAME_CHECKMATE != 0);
 
-    static_assert(GAME_STALEMATE == 1);
-    static_assert(GAME_CHECKMATE == -1);
-    static_assert(GAME_NORMAL == 0);
+int quiescence(int alpha, int beta) {
+    SEARCH_TIMEOUT
 
-    static_assert((STATE_RETVALUE(GAME_STALEMATE)) == 0);
-    static_assert((STATE_RETVALUE(GAME_CHECKMATE)) == -INFINITY);
-#endif
+    TRACE_ENTER(qsearch_root_ply - PLY, alpha, beta)
 
-// maybe slightly more expensive than storing it in a variable
-#define GAME_STATE chess_get_game_state(board)
+    nodes++;
+    STAT(searched_nodes) += collect_stats;
+    STAT(qsearch_depth)[TELEMETRY_BUCKET(PLY - qsearch_root_ply, TELEMETRY_QSEARCH_DEPTHS)] += collect_stats;
 
-    if (GAME_STATE) {
-        return STATE_RETVALUE(GAME_STATE);
+    if (pos->halfmove >= 100 || is_repetition()) {
+        TRACE_SET(reason, TRACE_REASON_DRAW)
+        return TRACE_EXIT(TRACE_KIND_QSEARCH, 0);
     }
 
-    int alpha_orig = alpha, bestValue = NEGATIVE_INFINITY, bestMoveIndex = 0;
+    // any entry of this position is at least QSEARCH_DEPTH deep, so only the bound matters
+    const bool tt_hit = ENTRY.hash == TT_KEY;
+    if (tt_hit
+        && (ENTRY.type == TYPE_EXACT || (ENTRY.type == TYPE_LOWER_BOUND && TT_EVAL >= beta)
+            || (ENTRY.type == TYPE_UPPER_BOUND && TT_EVAL < alpha))) {
+        STAT(qsearch_tt_cutoffs) += collect_stats;
+        TRACE_SET(reason, TRACE_REASON_TT_CUTOFF)
+        TRACE_SET(tt, TRACE_TT_CUTOFF)
+        return TRACE_EXIT(TRACE_KIND_QSEARCH, TT_EVAL);
+    }
+    TRACE_SET(tt, tt_hit ? TRACE_TT_BOUND : TRACE_TT_MISS)
 
-    if (is_not_quiescence) {
-        if (ENTRY.depth >= depthleft && ENTRY.hash == HASH
-            && (ENTRY.type == TYPE_EXACT || (ENTRY.type == TYPE_LOWER_BOUND && ENTRY.eval >= beta)
-                || (ENTRY.type == TYPE_UPPER_BOUND && ENTRY.eval < alpha))) {
-#ifdef STATS
-            transposition_hits++;
-            cached_nodes += ENTRY.stats.num_nodes;
-#endif
-            return ENTRY.eval;
-        }
+    int alpha_orig = alpha, bestMoveIndex = -1;
+
+    int bestValue;
+    if (tt_hit && ENTRY.static_eval != NO_STATIC_EVAL) {
+        bestValue = ENTRY.static_eval;
+        STAT(static_eval_hits) += collect_stats;
     }
     else {
-        bestValue = static_eval_me(WHITE) - static_eval_me(BLACK),      //
-            bestValue *= chess_is_white_turn(board) ? 1 : NEGATIVE_ONE, //
-            alpha = max_best_value_and(alpha);                          //
+        bestValue = evaluate();
+    }
+    const int static_eval = bestValue;
+
+    // the full list is needed to tell mate and stalemate apart from quiet positions
+    const bool in_check = position_in_check(pos);
+
+    Move moves[MAX_MOVES];
+    int len_moves = position_generate_moves(pos, moves, false);
+
+    if (!len_moves) {
+        TRACE_SET(reason, in_check ? TRACE_REASON_MATE : TRACE_REASON_STALEMATE)
+        return TRACE_EXIT(TRACE_KIND_QSEARCH, in_check ? MATED_SCORE : 0);
+    }
+
+    // in check there is no standing pat and every evasion gets searched, otherwise only captures
+    if (in_check) {
+        bestValue = MATED_SCORE;
+    }
+    else {
+        int len_captures = 0;
+        ITERATE_MOVES {
+            if (moves[i].capture) {
+                moves[len_captures++] = moves[i];
+            }
+        }
+        len_moves = len_captures;
+    }
+
+// qsearch may only take empty slots or ones holding other qsearch results,
+// so the main search replacement scheme never sees it
+#define QSEARCH_STORE(FROM, TO)                                                         \
+    if (ENTRY.depth == QSEARCH_DEPTH) {                                                 \
+        hashes_used += collect_stats && ENTRY.type == TYPE_UNUSED;                      \
+        TRACE_SET(tt, TRACE_NODE.tt | TRACE_TT_STORED)                                  \
+        ENTRY.hash = TT_KEY,                                                            \
+            ENTRY.eval = SCORE_TO_TT(bestValue),                                        \
+            ENTRY.static_eval = static_eval,                                            \
+            ENTRY.type = bestValue <= alpha_orig ? TYPE_UPPER_BOUND                     \
+                       : bestValue >= beta       ? TYPE_LOWER_BOUND                     \
+                                                 : TYPE_EXACT,                          \
+            ENTRY.bestMove_from = FROM,                                                 \
+            ENTRY.bestMove_to = TO;                                                     \
+    }
+
+    alpha = max_best_value_and(alpha);
+    if (alpha >= beta) {
+        TRACE_SET(reason, TRACE_REASON_STAND_PAT)
+        QSEARCH_STORE(0, 0)
+        return TRACE_EXIT(TRACE_KIND_QSEARCH, alpha);
+    }
+
+    SORT_MOVES
+
+    ITERATE_MOVES {
+        MAKE_MOVE(moves[i])
+        int score = -quiescence(NORMAL_WINDOW);
+        TRACE_COUNT(moves_searched)
+        UNDO_MOVE
+        SEARCH_ABORTED(return 0;)
+
+        if (score > bestValue) {
+            bestMoveIndex = i,     //
+                bestValue = score; //
+        }
+        alpha = max_best_value_and(alpha);
+        if (alpha >= beta) {
+            TRACE_SET(reason, TRACE_REASON_BETA_CUTOFF)
+            break;
+        }
+    }
+
+    // no move beat the static eval, 0 -> 0 never matches a real move
+    QSEARCH_STORE(bestMoveIndex < 0 ? 0 : SQUARE_OF(moves[bestMoveIndex].from), bestMoveIndex < 0 ? 0 : SQUARE_OF(moves[bestMoveIndex].to))
+
+    return TRACE_EXIT(TRACE_KIND_QSEARCH, bestValue);
+}
+
+
+static inline __attribute__((always_inline)) int search(const int node_type, int depthleft, int alpha, int beta) {
+#define is_pv_node (node_type == NODE_PV)
+
+    nodes++;
+    STAT(searched_nodes) += collect_stats;
+    uint64_t old_nodes = STAT(searched_nodes) + STAT(cached_nodes);
+
+#define DEPTH_BUCKET TELEMETRY_BUCKET(depthleft, TELEMETRY_DEPTHS)
+
+    // checkmate and stalemate fall out of the move list further down
+    if (pos->halfmove >= 100 || is_repetition()) {
+        TRACE_SET(reason, TRACE_REASON_DRAW)
+        return 0;
     }
+
+    // mate distance pruning: even mating right away can't beat a shorter mate that was already found
+    alpha = MAX(alpha, MATED_SCORE);
+    beta = MIN(beta, -MATED_SCORE - 1);
     if (alpha >= beta) {
+        TRACE_SET(reason, TRACE_REASON_MATE_DISTANCE)
         return alpha;
     }
 
-#define NULL_WINDOW -alpha - 1, -alpha
-#define NORMAL_WINDOW -beta, -alpha
+    int alpha_orig = alpha, bestValue = NEGATIVE_INFINITY, bestMoveIndex = 0;
+
+    if (ENTRY.depth >= depthleft && ENTRY.hash == TT_KEY
+        && (ENTRY.type == TYPE_EXACT || (ENTRY.type == TYPE_LOWER_BOUND && TT_EVAL >= beta)
+            || (ENTRY.type == TYPE_UPPER_BOUND && TT_EVAL < alpha))) {
+        if (collect_stats) {
+            STAT(transposition_hits)++;
+            STAT(cached_nodes) += ENTRY_NODES;
+            STAT(tt_probes)[DEPTH_BUCKET][TT_PROBE_CUTOFF]++;
+        }
+        TRACE_SET(reason, TRACE_REASON_TT_CUTOFF)
+        TRACE_SET(tt, TRACE_TT_CUTOFF)
+        return TT_EVAL;
+    }
+
+    STAT(tt_probes)[DEPTH_BUCKET][TT_PROBE_OUTCOME] += collect_stats;
+    // the trace enum is the probe outcome shifted by one for TRACE_TT_NONE
+    TRACE_SET(tt, TT_PROBE_OUTCOME + 1)
+
+#ifdef SYZYGY
+    // WDL ignores the 50 move counter, so only trust it right after a capture or pawn move.
+    // That's also exactly when the piece count drops into tablebase range.
+    // The root is handled by tb_root_move.
+    if (PLY && !pos->halfmove && TB_PROBEABLE) {
+        unsigned wdl = tb_probe_wdl(TB_POSITION, 0, 0, TB_EP_SQUARE, pos->side == WHITE);
+        if (wdl != TB_RESULT_FAILED) {
+            STAT(tb_hits) += collect_stats;
+            TRACE_SET(reason, TRACE_REASON_TABLEBASE)
+            // cursed wins and blessed losses are draws under the 50 move rule
+            return wdl == TB_WIN ? TB_WIN_SCORE - (int)PLY : wdl == TB_LOSS ? (int)PLY - TB_WIN_SCORE : 0;
+        }
+    }
+#endif
 
     FETCH_MOVES
+
+    if (!len_moves) {
+        TRACE_SET(reason, position_in_check(pos) ? TRACE_REASON_MATE : TRACE_REASON_STALEMATE)
+        return position_in_check(pos) ? MATED_SCORE : 0;
+    }
+
     SORT_MOVES
 
     ITERATE_MOVES {
-        if (is_not_quiescence || moves[i].capture) {
-            chess_make_move(board, moves[i]);
+        MAKE_MOVE(moves[i])
 
-            int score;
-            if (depthleft <= 2 || i == 0) {
-                score = -alphaBeta(depthleft - 1, NORMAL_WINDOW);
-            }
-            else {
+        int score;
+        if (depthleft <= 2 || i == 0) {
+            // in a non-PV node the normal window already is a null window
+            score = -alphaBeta(node_type, depthleft - 1, NORMAL_WINDOW);
+        }
+        else {
 #define do_reduce !(moves[i].capture || i < 3)
+#define lmr_reduction (do_reduce * (len_moves * PARAM(LMR_MOVES) + depthleft * PARAM(LMR_DEPTH)) / 1000)
 
-                score = -alphaBeta(depthleft - 1 - do_reduce * (len_moves * 93 + depthleft * 144) / 1000, NULL_WINDOW);
+            STAT(lmr_reductions)[DEPTH_BUCKET][TELEMETRY_BUCKET(lmr_reduction, TELEMETRY_REDUCTIONS)] += collect_stats;
 
-                if (score > alpha) {
-                    // low-depth search looks promising so retry with full depth.
-                    // This will always research even if we didn't even reduce depth.
-                    // The TT should catch that in most cases so it's cheap.
-                    //
-                    // if (!dont_reduce)
-                    score = -alphaBeta(depthleft - 1, NULL_WINDOW);
+            score = -alphaBeta(NODE_NON_PV, depthleft - 1 - lmr_reduction, NULL_WINDOW);
+            TRACE_COUNT(late_moves)
 
-#ifdef STATS
-                    lmr_misses++;
-                }
-                else {
-                    lmr_hits++;
-#endif
-                }
+            if (score > alpha) {
+                // low-depth search looks promising so retry with full depth.
+                // This will always research even if we didn't even reduce depth.
+                // The TT should catch that in most cases so it's cheap.
+                //
+                // if (!dont_reduce)
+                score = -alphaBeta(NODE_NON_PV, depthleft - 1, NULL_WINDOW);
+                STAT(lmr_misses) += collect_stats;
+                TRACE_COUNT(lmr_researches)
+            }
+            else {
+                STAT(lmr_hits) += collect_stats;
+            }
 
+            // full-depth search isn't conclusive, so try a full-window one.
+            // Non-PV nodes are searched with a null window anyway, so that would just repeat the search.
+            if (is_pv_node) {
                 if (score > alpha && score <= beta) {
-                    // full-depth search isn't conclusive, so try a full-window one
-                    score = -alphaBeta(depthleft - 1, NORMAL_WINDOW);
-#ifdef STATS
-                    negascout_misses++;
+                    score = -alphaBeta(NODE_PV, depthleft - 1, NORMAL_WINDOW);
+                    STAT(negascout_misses) += collect_stats;
+                    TRACE_COUNT(pvs_researches)
                 }
                 else {
-                    negascout_hits++;
-#endif
+                    STAT(negascout_hits) += collect_stats;
                 }
             }
-            chess_undo_move(board);
+        }
+        TRACE_COUNT(moves_searched)
+        UNDO_MOVE
+        SEARCH_ABORTED(return 0;)
 
+        if (score > bestValue) {
+            bestMoveIndex = i,     //
+                bestValue = score; //
+        }
 
-            if (score > bestValue) {
-                bestMoveIndex = i,     //
-                    bestValue = score; //
-            }
-
-            alpha = max_best_value_and(alpha);
-            if (alpha >= beta) {
-#ifdef STATS
-                if (i == 0) {
-                    first_move_cuts++;
-                }
-                else {
-                    first_move_non_cuts++;
-                }
-#endif
+        alpha = max_best_value_and(alpha);
+        if (alpha >= beta) {
+            TRACE_SET(reason, TRACE_REASON_BETA_CUTOFF)
+            STAT(first_move_cuts) += collect_stats && i == 0;
+            STAT(first_move_non_cuts) += collect_stats && i != 0;
+            STAT(cutoff_move_index)[DEPTH_BUCKET][TELEMETRY_BUCKET(i, TELEMETRY_MOVE_INDICES)] += collect_stats;
 
 #define HISTORY_UPDATE_INDEX INDEX_HISTORY_TABLE(moves[i].from, moves[i].to)
 
-                // this version is slightly better for some reason
-#define UPDATE_HISTORY(BONUS) HISTORY_UPDATE_INDEX -= HISTORY_UPDATE_INDEX * BONUS / MAX_HISTORY - BONUS
-                // #define UPDATE_HISTORY(BONUS) HISTORY_UPDATE_INDEX += BONUS - HISTORY_UPDATE_INDEX * BONUS / MAX_HISTORY
-                if (is_not_quiescence && !moves[i].capture) {
-                    int bonus = 300 * depthleft - 250;
-                    UPDATE_HISTORY(bonus);
+            // this version is slightly better for some reason
+#define UPDATE_HISTORY(BONUS) HISTORY_UPDATE_INDEX -= HISTORY_UPDATE_INDEX * BONUS / PARAM(MAX_HISTORY) - BONUS
+            // #define UPDATE_HISTORY(BONUS) HISTORY_UPDATE_INDEX += BONUS - HISTORY_UPDATE_INDEX * BONUS / MAX_HISTORY
+            if (!moves[i].capture) {
+                int bonus = PARAM(HISTORY_BONUS_DEPTH) * depthleft - PARAM(HISTORY_BONUS_OFFSET);
+                UPDATE_HISTORY(bonus);
 
-                    bonus /= -8;
+                bonus /= -PARAM(HISTORY_MALUS_DIVISOR);
 
-                    while (--i >= 0) {
-                        if (!moves[i].capture) {
-                            UPDATE_HISTORY(bonus);
-                        }
+                while (--i >= 0) {
+                    if (!moves[i].capture) {
+                        UPDATE_HISTORY(bonus);
                     }
                 }
-                break;
             }
+            break;
         }
     }
 
 
     // cannot be simplified because even though the depth is good, the score might not cause a cutoff
-    if (is_not_quiescence && (ENTRY.depth < depthleft || ENTRY.hash != HASH)) {
-#ifdef STATS
-        ENTRY.stats.num_nodes = (searched_nodes + cached_nodes) - (old_searched_nodes + old_cached_nodes);
-        if (ENTRY.type == TYPE_UNUSED) {
-            hashes_used++;
-            new_hashes++;
-        }
-        else {
-            transposition_overwrites++;
+    if (ENTRY.depth < depthleft || ENTRY.hash != TT_KEY) {
+        if (collect_stats) {
+            ENTRY_NODES = (STAT(searched_nodes) + STAT(cached_nodes)) - old_nodes;
+            if (ENTRY.type == TYPE_UNUSED) {
+                hashes_used++;
+                STAT(new_hashes)++;
+            }
+            else {
+                STAT(transposition_overwrites)++;
+            }
         }
-#endif
+        TRACE_SET(tt, TRACE_NODE.tt | TRACE_TT_STORED)
 
-        ENTRY.hash = HASH,                                                                  //
-            ENTRY.eval = bestValue,                                                         //
+        // keep the static eval if qsearch already cached it for this position
+        ENTRY.static_eval = ENTRY.hash == TT_KEY ? ENTRY.static_eval : NO_STATIC_EVAL,      //
+            ENTRY.hash = TT_KEY,                                                            //
+            ENTRY.eval = SCORE_TO_TT(bestValue),                                            //
             ENTRY.depth = depthleft,                                                        //
             ENTRY.type = bestValue <= alpha_orig ? TYPE_UPPER_BOUND                         //
                        : bestValue >= beta       ? TYPE_LOWER_BOUND                         //
                                                  : TYPE_EXACT,                                    //
-            ENTRY.bestMove_from = chess_get_index_from_bitboard(moves[bestMoveIndex].from), //
-            ENTRY.bestMove_to = chess_get_index_from_bitboard(moves[bestMoveIndex].to);     //
+            ENTRY.bestMove_from = SQUARE_OF(moves[bestMoveIndex].from),                     //
+            ENTRY.bestMove_to = SQUARE_OF(moves[bestMoveIndex].to);                         //
     }
 
     return bestValue;
 }
 
+// the timeout lives out here because functions using __builtin_longjmp can't be inlined
+int pvSearch(int depthleft, int alpha, int beta) {
+    SEARCH_TIMEOUT
+    TRACE_ENTER(depthleft, alpha, beta)
+    return TRACE_EXIT(TRACE_KIND_PV, search(NODE_PV, depthleft, alpha, beta));
+}
+
+int nonPvSearch(int depthleft, int alpha, int beta) {
+    SEARCH_TIMEOUT
+    TRACE_ENTER(depthleft, alpha, beta)
+    return TRACE_EXIT(TRACE_KIND_NON_PV, search(NODE_NON_PV, depthleft, alpha, beta));
+}
+
 #ifdef STATS
-void print_tt_stats(uint64_t prev_searched_nodes) {
+Telemetry telemetry_total() {
+    Telemetry total = {0};
+    for (int thread = 0; thread < SEARCH_THREADS; thread++) {
+        for (size_t i = 0; i < sizeof(Telemetry) / sizeof(uint64_t); i++) {
+            ((uint64_t*)&total)[i] += ((const uint64_t*)&telemetry[thread])[i];
+        }
+    }
+    return total;
+}
+
+// where the JSON lines go. stdout as info strings unless THERA_TELEMETRY names a file
+FILE* telemetry_file;
+
+void print_json_array(const char* name, const uint64_t* values, int rows, int columns) {
+    fprintf(telemetry_file, ",\"%s\":[", name);
+    for (int row = 0; row < rows; row++) {
+        if (columns > 1) {
+            fprintf(telemetry_file, "%s[", row ? "," : "");
+        }
+        for (int column = 0; column < columns; column++) {
+            fprintf(telemetry_file, "%s%lu", row * (columns == 1) + column ? "," : "", values[row * columns + column]);
+        }
+        if (columns > 1) {
+            fprintf(telemetry_file, "]");
+        }
+    }
+    fprintf(telemetry_file, "]");
+}
+
+void dump_telemetry(const Telemetry* t, int depth) {
+    if (telemetry_file == stdout) {
+        fprintf(telemetry_file, "info string telemetry ");
+    }
+    fprintf(
+        telemetry_file,
+        "{\"depth\":%d,\"time\":%ld,\"nodes\":%lu,\"hashes_used\":%lu",
+        depth,
+        ELAPSED_MILLIS,
+        nodes,
+        hashes_used
+    );
+#define DUMP_COUNTER(FIELD) fprintf(telemetry_file, ",\"" #FIELD "\":%lu", t->FIELD);
+    DUMP_COUNTER(searched_nodes)
+    DUMP_COUNTER(transposition_hits)
+    DUMP_COUNTER(cached_nodes)
+    DUMP_COUNTER(transposition_overwrites)
+    DUMP_COUNTER(new_hashes)
+    DUMP_COUNTER(researches)
+    DUMP_COUNTER(first_move_cuts)
+    DUMP_COUNTER(first_move_non_cuts)
+    DUMP_COUNTER(negascout_hits)
+    DUMP_COUNTER(negascout_misses)
+    DUMP_COUNTER(lmr_hits)
+    DUMP_COUNTER(lmr_misses)
+    DUMP_COUNTER(qsearch_tt_cutoffs)
+    DUMP_COUNTER(static_eval_hits)
+    DUMP_COUNTER(eval_cache_probes)
+    DUMP_COUNTER(eval_cache_hits)
+    DUMP_COUNTER(pawn_hash_probes)
+    DUMP_COUNTER(pawn_hash_hits)
+    DUMP_COUNTER(tb_hits)
+#undef DUMP_COUNTER
+    print_json_array("tt_probes", *t->tt_probes, TELEMETRY_DEPTHS, TT_PROBE_OUTCOMES);
+    print_json_array("cutoff_move_index", *t->cutoff_move_index, TELEMETRY_DEPTHS, TELEMETRY_MOVE_INDICES);
+    print_json_array("lmr_reductions", *t->lmr_reductions, TELEMETRY_DEPTHS, TELEMETRY_REDUCTIONS);
+    print_json_array("qsearch_depth", t->qsearch_depth, TELEMETRY_QSEARCH_DEPTHS, 1);
+    fprintf(telemetry_file, "}\n");
+    fflush(telemetry_file);
+}
+
+void print_tt_stats(const Telemetry* t, uint64_t prev_searched_nodes) {
     printf(
         "info string %ldms left\n"
         "info string Transposition Table\n"
@@ -426,6 +1050,9 @@ void print_tt_stats(uint64_t prev_searched_nodes) {
         "info string    overwrites: %lu\n"
         "info string        rate: %f%%\n"
         "info string    new_hashes: %lu\n"
+        "info string Evaluation\n"
+        "info string    eval cache hits: %f%%\n"
+        "info string    pawn hash hits: %f%%\n"
         "info string Alpha-Beta Search\n"
         "info string    first move cuts: %f%%\n"
         "info string    negascout hits: %lu\n"
@@ -437,125 +1064,126 @@ void print_tt_stats(uint64_t prev_searched_nodes) {
         "info string Root Search\n"
         "info string    branching factor: %f\n"
         "info string    aspiration researches: %lu\n",
-        (int64_t)chess_get_time_millis(),
-        transposition_hits,
-        (float)transposition_hits / (float)(searched_nodes) * 100.0f,
-        (float)cached_nodes / (float)(searched_nodes + cached_nodes) * 100.0f,
-        transposition_overwrites,
-        (float)transposition_overwrites / (float)(transposition_overwrites + new_hashes) * 100.0f,
-        new_hashes,
-        (float)first_move_cuts / (float)(first_move_non_cuts + first_move_cuts) * 100.0f,
-        negascout_hits,
-        negascout_misses,
-        (float)negascout_hits / (float)(negascout_hits + negascout_misses) * 100.0f,
-        lmr_hits,
-        lmr_misses,
-        (float)lmr_hits / (float)(lmr_hits + lmr_misses) * 100.0f,
-        (float)searched_nodes / (float)prev_searched_nodes,
-        researches
+        TIME_LEFT_MILLIS,
+        t->transposition_hits,
+        (float)t->transposition_hits / (float)(t->searched_nodes) * 100.0f,
+        (float)t->cached_nodes / (float)(t->searched_nodes + t->cached_nodes) * 100.0f,
+        t->transposition_overwrites,
+        (float)t->transposition_overwrites / (float)(t->transposition_overwrites + t->new_hashes) * 100.0f,
+        t->new_hashes,
+        (float)t->eval_cache_hits / (float)(t->eval_cache_probes) * 100.0f,
+        (float)t->pawn_hash_hits / (float)(t->pawn_hash_probes) * 100.0f,
+        (float)t->first_move_cuts / (float)(t->first_move_non_cuts + t->first_move_cuts) * 100.0f,
+        t->negascout_hits,
+        t->negascout_misses,
+        (float)t->negascout_hits / (float)(t->negascout_hits + t->negascout_misses) * 100.0f,
+        t->lmr_hits,
+        t->lmr_misses,
+        (float)t->lmr_hits / (float)(t->lmr_hits + t->lmr_misses) * 100.0f,
+        (float)t->searched_nodes / (float)prev_searched_nodes,
+        t->researches
     );
     fflush(stdout);
 }
-void print_stats(int depth, int bestValue, uint64_t prev_searched_nodes) {
+void print_stats(const Telemetry* t, int depth, int bestValue, Move bestMove, uint64_t prev_searched_nodes) {
+    char pv[6];
+    board_format_move(bestMove, pv);
     printf(
-        "info depth %d score cp %d nodes %lu nps %lu hashfull %lu time %lu\n",
+        "info depth %d score %s %d nodes %lu nps %lu hashfull %lu tbhits %lu time %ld pv %s\n",
         depth,
-        bestValue,
-        searched_nodes,
-        (searched_nodes * 1000) / (chess_get_elapsed_time_millis() + 1),
+        IS_MATE(bestValue) ? "mate" : "cp",
+        // uci wants mates in moves, negative when getting mated
+        IS_MATE(bestValue) ? (bestValue > 0 ? INFINITY - bestValue + 1 : -INFINITY - bestValue) / 2 : bestValue,
+        t->searched_nodes,
+        (t->searched_nodes * 1000) / (ELAPSED_MILLIS + 1),
         hashes_used * 1000 / TRANSPOSITION_SIZE,
-        chess_get_elapsed_time_millis()
+        t->tb_hits,
+        ELAPSED_MILLIS,
+        pv
     );
-    print_tt_stats(prev_searched_nodes);
+    print_tt_stats(t, prev_searched_nodes);
     fflush(stdout);
 }
-#endif
 
-int main() {
-    // gcc doesn't like recursive main for some reason.
-    // I guess we won't save that token
-main_top:
+// bench has its own summary
+bool quiet_search;
+#endif
 
-    board = chess_get_board();
+#ifdef PONDER
+// the ponder search and the real search after it share the history
+bool keep_history;
+#endif
 
+// Searches position_stack[0] until the time limit or max_depth is hit or a mate is found.
+// Expects the root to already be in the repetition ring.
+Move iterative_deepening(int max_depth) {
     // including the sort here saved one token at some point
     // TODO: recheck (we have enough tokens so no need to)
     FETCH_MOVES
     SORT_MOVES
 
 #ifdef STATS
-    uint64_t prev_searched_nodes = 0;
-    searched_nodes = 1;
+    uint64_t prev_searched_nodes = 1;
 #endif
 
+#ifdef PONDER
+    if (!keep_history) {
+        __builtin_memset(history_table, 0, sizeof history_table);
+    }
+#else
     __builtin_memset(history_table, 0, sizeof history_table);
+#endif
 
     // static to prevent longjmp clobbering
-    static Move prevBestMove, bestMove;
-    prevBestMove = bestMove = *moves;
+    static Move bestMove;
+    bestMove = *moves;
 
     int prevBestValue = 0, depthleft = 0; // start searching at depth 0 for move ordering
 
-    // stop searching if we found guaranteed mate
-    while (prevBestValue < INFINITY) {
+    // stop once the mate is within the searched depth, no deeper search can find a shorter one
+    while (INFINITY - __builtin_abs(prevBestValue) > depthleft && depthleft < max_depth) {
         depthleft++;
+        TRACE_ITERATION(depthleft)
 
-#ifdef STATS
-        prev_searched_nodes = searched_nodes;
-
-        searched_nodes = 0;
-        transposition_hits = 0;
-        cached_nodes = 0;
-        transposition_overwrites = 0;
-        new_hashes = 0;
-        researches = 0;
-
-        first_move_cuts = 0;
-        first_move_non_cuts = 0;
-
-        negascout_hits = 0;
-        negascout_misses = 0;
-
-        lmr_hits = 0;
-        lmr_misses = 0;
-#endif
+        if (collect_stats) {
+            __builtin_memset(telemetry, 0, sizeof telemetry);
+        }
+#ifndef STOP_FLAG
         if (__builtin_setjmp(history_table + JUMP_BUFFER_OFFSET)) {
             goto search_canceled;
         }
+#endif
 
         int bestValue = NEGATIVE_INFINITY;
 
         SORT_MOVES
 
         ITERATE_MOVES {
-            chess_make_move(board, moves[i]);
-            int alphaOffset = 25, betaOffset = 25;
-#ifdef STATS
-            researches--; // remove the initial overcount
-#endif
+            MAKE_MOVE(moves[i])
+            int alphaOffset = PARAM(ASPIRATION_WINDOW), betaOffset = PARAM(ASPIRATION_WINDOW);
+            STAT(researches) -= collect_stats; // remove the initial overcount
         aspiration_fail:
-#ifdef STATS
-            researches++;
-#endif
+            STAT(researches) += collect_stats;
             // invert prevBestValue back, because we also invert the search results
-            int score = -alphaBeta(depthleft - 1, -prevBestValue - alphaOffset, -prevBestValue + betaOffset);
+            int score = -alphaBeta(NODE_PV, depthleft - 1, -prevBestValue - alphaOffset, -prevBestValue + betaOffset);
+            SEARCH_ABORTED(goto search_canceled;)
             // don't invert because both are inverted once
             if (score <= prevBestValue - alphaOffset && score > bestValue) {
                 // fail-low: the real score is lower than alpha (aka. prevBestValue - alphaOffset).
                 // still worth searching though because it is still higher than bestValue
 
-                alphaOffset *= 4;
+                alphaOffset *= PARAM(ASPIRATION_WIDENING);
                 goto aspiration_fail;
             }
             if (score >= prevBestValue + betaOffset) {
                 // fail-high: the real score is higher than beta (aka. prevBestValue + betaOffset).
                 // so we keep searching with a bigger window
                 //
-                betaOffset *= 4;
+                betaOffset *= PARAM(ASPIRATION_WIDENING);
                 goto aspiration_fail;
             }
 
-            chess_undo_move(board);
+            UNDO_MOVE
 
             if (score > bestValue) {
                 bestValue = prevBestValue = score, //
@@ -564,15 +1192,492 @@ main_top:
         }
 
 #ifdef STATS
-        print_stats(depthleft - 1, bestValue, prev_searched_nodes);
+        Telemetry total = telemetry_total();
+        if (!quiet_search) {
+            print_stats(&total, depthleft, bestValue, bestMove, prev_searched_nodes);
+            dump_telemetry(&total, depthleft);
+        }
+        prev_searched_nodes = total.searched_nodes;
 #endif
+    }
 
+search_canceled:
+    pos = position_stack;
 
-        prevBestMove = bestMove;
+    return bestMove;
+}
+
+#ifdef BENCH
+// fixed positions searched to a fixed depth without a time limit, so the node count is a
+// signature of the search that only changes when its behaviour does
+const char* bench_positions[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1p2ppp/2pp4/4p3/P7/2P1PbP1/RP5P/2Q2K1R w kq - 0 20",
+    "r1bqk1nr/pppp2pp/2n2p2/6B1/1b5Q/P7/1PP1PPPP/RN2KBNR w KQkq - 3 6",
+    "rn2k1nr/ppp2ppp/4p3/2bp1b2/7q/P7/RPPPPPPP/1NBQKBNR w Kkq - 6 7",
+    "rn2k1nr/ppp2ppp/4p3/2bp1b2/3q4/P7/RPP1PPPP/1NBQKBNR w Kkq - 0 8",
+    "r5k1/p6p/6p1/2Qb1r2/P6K/8/RP5P/6R1 w - - 0 33",
+    "8/3K4/4P3/8/8/8/6k1/7q w - - 0 1",
+    "8/8/4k3/8/8/4K3/4R3/4R3 w - - 0 1",
+    "k7/8/1R6/1K6/8/8/8/8 w - - 18 10",
+    "2k5/8/2K5/8/8/8/4R3/1R6 w - - 16 9",
+    "3k4/8/8/8/8/8/8/3R3K b - - 0 1",
+    "8/4k3/8/4K3/8/8/8/2R5 w - - 41 22",
+};
+
+#define BENCH_DEPTH 10
+
+int bench(int depth) {
+    time_limit_millis = 0;
+    quiet_search = true;
+    nodes = 0;
+
+    int64_t start = now_millis();
+
+    for (size_t i = 0; i < sizeof bench_positions / sizeof *bench_positions; i++) {
+        position_from_fen(pos = position_stack, bench_positions[i]);
+        game_ply = 0;
+        repetition_ring[RING_INDEX(0)] = pos->key;
+
+        uint64_t position_nodes = nodes;
+        Move bestMove = iterative_deepening(depth);
+
+        int from = SQUARE_OF(bestMove.from), to = SQUARE_OF(bestMove.to);
+        printf(
+            "position %zu: bestmove %c%c%c%c nodes %lu\n",
+            i + 1,
+            'a' + from % 8,
+            '1' + from / 8,
+            'a' + to % 8,
+            '1' + to / 8,
+            nodes - position_nodes
+        );
     }
 
+    int64_t elapsed = now_millis() - start;
 
-search_canceled:
+    // same layout as Stockfish so the usual bench scripts can parse it
+    fflush(stdout);
+    fprintf(
+        stderr,
+        "===========================\n"
+        "Total time (ms) : %ld\n"
+        "Nodes searched  : %lu\n"
+        "Nodes/second    : %lu\n",
+        elapsed,
+        nodes,
+        nodes * 1000 / (elapsed + 1)
+    );
+    return 0;
+}
+#endif
+
+#ifdef BOOK
+// set with THERA_BOOK, built by make_book
+Book book;
+#endif
+
+#ifdef UCI
+// main is the input thread and keeps reading while a search thread runs,
+// so stop and isready are answered in the middle of a search
+pthread_t search_thread;
+bool search_running;
+bool search_infinite; // go infinite and go ponder may only report their bestmove after stop
+int search_max_depth;
+int64_t ponder_time_limit; // takes effect on ponderhit
+int64_t move_overhead = 30;
+
+void* uci_search(void* arg) {
+    (void)arg;
+
+    Move moves[MAX_MOVES];
+    Move bestMove = {0};
+    if (position_generate_moves(pos, moves, false)
+#ifdef SYZYGY
+        // same as the chessapi main, a won ending is converted with the DTZ move
+        && !(TB_PROBEABLE && tb_root_move(&bestMove))
+#endif
+    ) {
+        bestMove = iterative_deepening(search_max_depth);
+    }
+
+    while (__atomic_load_n(&search_infinite, __ATOMIC_RELAXED) && !__atomic_load_n(&stop_search, __ATOMIC_RELAXED)) {
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&idle, NULL);
+    }
+
+    char name[6];
+    board_format_move(bestMove, name);
+    printf("bestmove %s\n", name);
+    fflush(stdout);
+    return NULL;
+}
+
+// position and options only ever change between searches
+void uci_wait() {
+    if (search_running) {
+        pthread_join(search_thread, NULL);
+        search_running = false;
+    }
+}
+
+void uci_position(char* args) {
+    char* moves = strstr(args, " moves ");
+    position_from_fen(pos = position_stack, !strncmp(args, "fen ", 4) ? args + 4 : STARTPOS);
+    game_ply = 0;
+    repetition_ring[RING_INDEX(0)] = pos->key;
+
+    for (char* token = moves ? strtok(moves + 7, " ") : NULL; token; token = strtok(NULL, " ")) {
+        Move legal_moves[MAX_MOVES];
+        int len_moves = position_generate_moves(pos, legal_moves, false);
+        ITERATE_MOVES {
+            char name[6];
+            board_format_move(legal_moves[i], name);
+            if (!strcmp(name, token)) {
+                position_make_move(pos, pos + 1, legal_moves[i]);
+                *pos = pos[1];
+                game_ply++;
+                repetition_ring[RING_INDEX(0)] = pos->key;
+                break;
+            }
+        }
+    }
+}
+
+void uci_go(char* args) {
+    int64_t times[2] = {0}, increments[2] = {0}, movetime = 0, movestogo = 0;
+    int depth = MAX_PLY - 64;
+    bool ponder = false;
+    node_limit = 0;
+    search_infinite = false;
+
+    for (char* token = strtok(args, " "); token; token = strtok(NULL, " ")) {
+        if (!strcmp(token, "infinite")) {
+            search_infinite = true;
+            continue;
+        }
+        if (!strcmp(token, "ponder")) {
+            ponder = true;
+            continue;
+        }
+
+        // every other limit takes a number
+        char* value = strtok(NULL, " ");
+        if (!value) {
+            break;
+        }
+        else if (!strcmp(token, "wtime")) {
+            times[WHITE] = atoll(value);
+        }
+        else if (!strcmp(token, "btime")) {
+            times[BLACK] = atoll(value);
+        }
+        else if (!strcmp(token, "winc")) {
+            increments[WHITE] = atoll(value);
+        }
+        else if (!strcmp(token, "binc")) {
+            increments[BLACK] = atoll(value);
+        }
+        else if (!strcmp(token, "movestogo")) {
+            movestogo = atoll(value);
+        }
+        else if (!strcmp(token, "movetime")) {
+            movetime = atoll(value);
+        }
+        else if (!strcmp(token, "depth")) {
+            depth = atoi(value) > 0 && atoi(value) < depth ? atoi(value) : depth;
+        }
+        else if (!strcmp(token, "nodes")) {
+            node_limit = strtoull(value, NULL, 10);
+        }
+    }
+
+    // same fraction as the chessapi loop, the overhead covers the GUI and pipe latency
+    uci_time_left = times[pos->side];
+    int64_t time_left = uci_time_left - move_overhead;
+    time_limit_millis = movetime               ? movetime
+                      : search_infinite        ? 0
+                      : uci_time_left          ? time_left / (movestogo ? movestogo : 40) + increments[pos->side] / 2
+                                               : 0;
+    if (uci_time_left && time_limit_millis > time_left) {
+        time_limit_millis = time_left;
+    }
+    if (time_limit_millis < 0 || (time_limit_millis == 0 && uci_time_left)) {
+        time_limit_millis = 1;
+    }
+
+    // pondering runs like an infinite search until ponderhit hands it the real limit
+    if (ponder) {
+        ponder_time_limit = time_limit_millis;
+        time_limit_millis = 0;
+        search_infinite = true;
+    }
+
+    search_max_depth = depth;
+    __atomic_store_n(&stop_search, false, __ATOMIC_RELAXED);
+    nodes = 0;
+    search_start_millis = now_millis();
+    search_running = pthread_create(&search_thread, NULL, uci_search, NULL) == 0;
+}
+
+void clear_hash() {
+    __builtin_memset(transposition_table, 0, sizeof transposition_table);
+    hashes_used = 0;
+}
+
+void uci_setoption(char* args) {
+    char* value = strstr(args, " value ");
+    if (value) {
+        *value = '\0';
+        value += 7;
+    }
+    const char* name = !strncmp(args, "name ", 5) ? args + 5 : args;
+
+    if (!strcmp(name, "Move Overhead") && value) {
+        move_overhead = atoll(value);
+    }
+    else if (!strcmp(name, "Clear Hash")) {
+        clear_hash();
+    }
+#ifdef TUNE
+    #define SET_PARAM(NAME, MIN, MAX)                                                      \
+        else if (!strcmp(name, #NAME) && value) {                                          \
+            tune_##NAME = atoi(value) < MIN ? MIN : atoi(value) > MAX ? MAX : atoi(value); \
+        }
+    SEARCH_PARAMS(SET_PARAM)
+#endif
+#ifdef SYZYGY
+    else if (!strcmp(name, "SyzygyPath") && value) {
+        tb_largest = tb_init(value) ? TB_LARGEST : 0;
+        TB_UPDATE_PIECES
+    }
+    else if (!strcmp(name, "SyzygyProbeLimit") && value) {
+        tb_probe_limit = atoi(value);
+        TB_UPDATE_PIECES
+    }
+#endif
+}
+
+int uci_loop() {
+    position_from_fen(pos = position_stack, STARTPOS);
+    repetition_ring[RING_INDEX(0)] = pos->key;
+
+    char line[16384];
+    while (fgets(line, sizeof line, stdin)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (!strcmp(line, "uci")) {
+            printf(
+                "id name thera_mini\n"
+                "id author Robotino04\n"
+                "option name Move Overhead type spin default 30 min 0 max 5000\n"
+                "option name Clear Hash type button\n"
+                "option name Ponder type check default false\n"
+#ifdef SYZYGY
+                "option name SyzygyPath type string default <empty>\n"
+                "option name SyzygyProbeLimit type spin default 7 min 0 max 7\n"
+#endif
+            );
+#ifdef TUNE
+    #define PRINT_PARAM(NAME, MIN, MAX) printf("option name " #NAME " type spin default %d min %d max %d\n", NAME, MIN, MAX);
+            SEARCH_PARAMS(PRINT_PARAM)
+#endif
+            printf("uciok\n");
+        }
+        else if (!strcmp(line, "isready")) {
+            printf("readyok\n");
+        }
+        else if (!strcmp(line, "ponderhit")) {
+            // the clock starts now, the time spent pondering was free
+            __atomic_store_n(&search_start_millis, now_millis(), __ATOMIC_RELAXED);
+            __atomic_store_n(&time_limit_millis, ponder_time_limit, __ATOMIC_RELAXED);
+            __atomic_store_n(&search_infinite, false, __ATOMIC_RELAXED);
+        }
+        else if (!strcmp(line, "stop")) {
+            __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+            uci_wait();
+        }
+        else if (!strcmp(line, "quit")) {
+            __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+            uci_wait();
+            return 0;
+        }
+        else if (!strcmp(line, "ucinewgame")) {
+            uci_wait();
+            clear_hash();
+        }
+        else if (!strncmp(line, "position ", 9)) {
+            uci_wait();
+            uci_position(line + 9);
+        }
+        else if (!strncmp(line, "go", 2)) {
+            uci_wait();
+            uci_go(line + 2);
+        }
+        else if (!strncmp(line, "setoption ", 10)) {
+            uci_wait();
+            uci_setoption(line + 10);
+        }
+        fflush(stdout);
+    }
+
+    __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+    uci_wait();
+    return 0;
+}
+#endif
+
+#ifdef PONDER
+// Searches the position after our move while the opponent thinks. The result is thrown away,
+// the point is the TT and the history it leaves behind for the real search.
+pthread_t ponder_thread;
+bool pondering;
+
+void* ponder(void* arg) {
+    (void)arg;
+    iterative_deepening(MAX_PLY - 64);
+    return NULL;
+}
+
+void ponder_start() {
+    // nothing to ponder once the game is over
+    Move moves[MAX_MOVES];
+    if (!position_generate_moves(&game_position, moves, false)) {
+        return;
+    }
+
+    // game_position already sits in the ring one ply after the root
+    position_stack[0] = game_position;
+    game_ply++;
+
+    time_limit_millis = 0;
+    quiet_search = true;
+    keep_history = true;
+    __atomic_store_n(&stop_search, false, __ATOMIC_RELAXED);
+    pondering = pthread_create(&ponder_thread, NULL, ponder, NULL) == 0;
+    game_ply -= !pondering;
+}
+
+// everything the ponder search touches is shared with the real one, so it has to be gone first
+void ponder_stop() {
+    if (pondering) {
+        __atomic_store_n(&stop_search, true, __ATOMIC_RELAXED);
+        pthread_join(ponder_thread, NULL);
+        pondering = false;
+        game_ply--;
+    }
+    else {
+        keep_history = false;
+    }
+    quiet_search = false;
+    __atomic_store_n(&stop_search, false, __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef BENCH
+int main(int argc, char** argv) {
+#else
+int main() {
+#endif
+    board_init();
+
+#ifdef TRACE
+    const char* trace_path = getenv("THERA_TRACE");
+    tracing = trace_path && trace_start(&trace_writer, trace_path, trace_rings, SEARCH_THREADS);
+    atexit(trace_finish);
+#endif
+
+#ifdef BOOK
+    // a missing book just never hits
+    const char* book_path = getenv("THERA_BOOK");
+    if (book_path && !book_open(&book, book_path)) {
+        fprintf(stderr, "couldn't open book %s\n", book_path);
+    }
+    srand(time(NULL));
+#endif
+
+#ifdef SYZYGY
+    const char* syzygy_path = getenv("THERA_SYZYGY");
+    if (syzygy_path && tb_init(syzygy_path)) {
+        const char* max_pieces = getenv("THERA_SYZYGY_PIECES");
+        tb_largest = TB_LARGEST;
+        tb_probe_limit = max_pieces ? (unsigned)atoi(max_pieces) : tb_probe_limit;
+        TB_UPDATE_PIECES
+    }
+#endif
+
+#ifdef STATS
+    const char* telemetry_path = getenv("THERA_TELEMETRY");
+    telemetry_file = telemetry_path ? fopen(telemetry_path, "a") : NULL;
+    telemetry_file = telemetry_file ? telemetry_file : stdout;
+#endif
+
+#ifdef BENCH
+    if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        return bench(argc >= 3 ? atoi(argv[2]) : BENCH_DEPTH);
+    }
+#endif
+
+#ifdef UCI
+    return uci_loop();
+#endif
+
+    // gcc doesn't like recursive main for some reason.
+    // I guess we won't save that token
+main_top:
+
+    board = chess_get_board();
+#ifdef PONDER
+    ponder_stop();
+#endif
+#ifdef STOP_FLAG
+    search_start_millis = now_millis();
+#endif
+    position_from_board(pos = position_stack, board);
+
+    // libchess has no halfmove clock or game history, so both are carried over from the last move.
+    // If no reply to it leads here, this is a new game.
+    {
+        // game_position is still all zeroes before our first move
+        Move moves[MAX_MOVES];
+        int len_moves = game_position.key ? position_generate_moves(&game_position, moves, false) : 0;
+        int previous_ply = game_ply;
+
+        game_ply = 0;
+        ITERATE_MOVES {
+            position_make_move(&game_position, pos + 1, moves[i]);
+            if (pos[1].key == pos->key) {
+                *pos = pos[1];
+                game_ply = previous_ply + 2;
+            }
+        }
+        repetition_ring[RING_INDEX(0)] = pos->key;
+    }
+
+    Move bestMove;
+#ifdef BOOK
+    // book moves are instant, the unused time stays on the clock for the rest of the game
+    if (book_probe(&book, pos, rand(), &bestMove)) {
+        goto play_move;
+    }
+#endif
+#ifdef SYZYGY
+    if (TB_PROBEABLE && tb_root_move(&bestMove)) {
+        goto play_move;
+    }
+#endif
+
+    time_limit_millis = MAX((int64_t)chess_get_time_millis() / 40, 1);
+
+    // qsearch needs headroom on the position stack for all the captures
+    bestMove = iterative_deepening(MAX_PLY - 64);
+
+#if defined(BOOK) || defined(SYZYGY)
+play_move:
+#endif
+
+    position_make_move(position_stack, &game_position, bestMove);
+    repetition_ring[RING_INDEX(1)] = game_position.key;
 
     // TODO: use partial search results
     chess_push(bestMove);
@@ -581,5 +1686,9 @@ search_canceled:
 
     chess_done();
 
+#ifdef PONDER
+    ponder_start();
+#endif
+
     goto main_top;
 }
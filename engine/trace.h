@@ -0,0 +1,175 @@
+#pragma once
+
+// Binary search tree traces for offline analysis (see trace_reader.cpp).
+//
+// Every search thread owns a single-producer ring buffer. The search only copies a record
+// into it and bumps the head, a background thread drains the rings to disk. If the flusher
+// falls behind, records are dropped instead of stalling the search.
+//
+// file layout: TraceHeader, then chunks of TraceChunk followed by chunk.count records
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TRACE_MAGIC 0x52544854 // "THTR"
+#define TRACE_VERSION 2
+
+#define TRACE_RING_SIZE (1 << 18)
+
+typedef enum {
+    TRACE_KIND_PV,
+    TRACE_KIND_NON_PV,
+    TRACE_KIND_QSEARCH,
+    TRACE_KIND_ITERATION, // marker, depth is the iteration that is about to start
+} TraceKind;
+
+// why a node stopped searching
+typedef enum {
+    TRACE_REASON_ALL_MOVES, // every move was searched (fail-low or exact)
+    TRACE_REASON_BETA_CUTOFF,
+    TRACE_REASON_TT_CUTOFF,
+    TRACE_REASON_STAND_PAT,
+    TRACE_REASON_DRAW,
+    TRACE_REASON_MATE,
+    TRACE_REASON_STALEMATE,
+    TRACE_REASON_MATE_DISTANCE,
+    TRACE_REASON_TABLEBASE,
+} TraceReason;
+
+// low bits: probe outcome, TRACE_TT_STORED is or'ed on top
+typedef enum {
+    TRACE_TT_NONE,
+    TRACE_TT_MISS,
+    TRACE_TT_SHALLOW,
+    TRACE_TT_BOUND,
+    TRACE_TT_CUTOFF,
+
+    TRACE_TT_PROBE_MASK = 0x7,
+    TRACE_TT_STORED = 0x8,
+} TraceTT;
+
+typedef struct {
+    uint16_t ply;
+    int16_t depth;    // remaining depth, <= 0 in qsearch. iterations go up to MAX_PLY - 64
+    uint8_t from, to; // move leading into this node
+    uint8_t kind;
+    uint8_t reason;
+    uint8_t tt;
+    uint8_t moves_searched;
+    uint8_t late_moves; // moves that went through the reduced null window search
+    uint8_t lmr_researches;
+    uint8_t pvs_researches;
+    int32_t alpha, beta, score; // window on entry
+} TraceRecord;
+
+static_assert(sizeof(TraceRecord) == 28, "TraceRecord layout changed");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t threads;
+} TraceHeader;
+
+typedef struct {
+    uint32_t thread;
+    uint32_t count;
+} TraceChunk;
+
+typedef struct {
+    // the producer and the flusher each get their own cache line
+    alignas(64) uint64_t head;
+    uint64_t dropped;
+    alignas(64) uint64_t tail;
+    alignas(64) TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+static inline void trace_push(TraceRing* ring, const TraceRecord* record) {
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+    ring->records[head % TRACE_RING_SIZE] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    FILE* file;
+    TraceRing* rings;
+    int num_rings;
+    bool stop;
+    pthread_t flusher;
+} TraceWriter;
+
+// writes out everything that is currently in the rings, returns false if there was nothing
+static inline bool trace_drain(TraceWriter* writer) {
+    bool wrote = false;
+    for (int i = 0; i < writer->num_rings; i++) {
+        TraceRing* ring = &writer->rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail != head) {
+            // up to the wrap-around, the rest goes in the next chunk
+            uint64_t start = tail % TRACE_RING_SIZE;
+            uint64_t count = head - tail < TRACE_RING_SIZE - start ? head - tail : TRACE_RING_SIZE - start;
+
+            TraceChunk chunk = {.thread = (uint32_t)i, .count = (uint32_t)count};
+            fwrite(&chunk, sizeof chunk, 1, writer->file);
+            fwrite(&ring->records[start], sizeof(TraceRecord), count, writer->file);
+
+            tail += count;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            wrote = true;
+        }
+    }
+    return wrote;
+}
+
+static inline void* trace_flusher(void* arg) {
+    TraceWriter* writer = (TraceWriter*)arg;
+    while (!__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE)) {
+        if (!trace_drain(writer)) {
+            fflush(writer->file);
+            struct timespec idle = {.tv_sec = 0, .tv_nsec = 1000000};
+            nanosleep(&idle, NULL);
+        }
+    }
+    trace_drain(writer);
+    return NULL;
+}
+
+static inline bool trace_start(TraceWriter* writer, const char* path, TraceRing* rings, int num_rings) {
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        return false;
+    }
+    writer->rings = rings;
+    writer->num_rings = num_rings;
+    writer->stop = false;
+
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(TraceRecord),
+        .threads = (uint32_t)num_rings,
+    };
+    fwrite(&header, sizeof header, 1, writer->file);
+
+    return pthread_create(&writer->flusher, NULL, trace_flusher, writer) == 0;
+}
+
+static inline void trace_stop(TraceWriter* writer) {
+    __atomic_store_n(&writer->stop, true, __ATOMIC_RELEASE);
+    pthread_join(writer->flusher, NULL);
+
+    for (int i = 0; i < writer->num_rings; i++) {
+        if (writer->rings[i].dropped) {
+            fprintf(stderr, "trace: thread %d dropped %lu records\n", i, (unsigned long)writer->rings[i].dropped);
+        }
+    }
+    fclose(writer->file);
+}
@@ -0,0 +1,215 @@
+// Aggregates a search trace written by a -DTRACE build of thera_mini (see trace.h).
+//
+// usage: trace_reader trace.bin
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "trace.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64
+// the engine stops at MAX_PLY - 64, deeper iterations are counted in the last one
+#define MAX_ITERATIONS 512
+
+struct DepthStats {
+    uint64_t nodes;
+    uint64_t moves_searched;
+    uint64_t beta_cutoffs;
+    uint64_t first_move_cutoffs;
+    uint64_t tt_cutoffs;
+    uint64_t late_moves;
+    uint64_t lmr_researches;
+    uint64_t pv_late_moves;
+    uint64_t pvs_researches;
+    uint64_t tt_stores;
+};
+
+// main search, keyed by remaining depth. all of qsearch goes into one bucket
+DepthStats depth_stats[MAX_DEPTH];
+DepthStats qsearch_stats;
+
+uint64_t reasons[TRACE_REASON_TABLEBASE + 1];
+uint64_t tt_outcomes[TRACE_TT_CUTOFF + 1];
+
+// nodes per iteration, summed over all searches, for the effective branching factor
+uint64_t iteration_nodes[MAX_ITERATIONS];
+// log(nodes(d) / nodes(d - 1)) summed over the searches that finished both iterations
+double iteration_log_ebf[MAX_ITERATIONS];
+uint64_t iteration_ebf_samples[MAX_ITERATIONS];
+
+const char* reason_names[] = {"all moves", "beta cutoff", "tt cutoff", "stand pat", "draw", "mate", "stalemate", "mate distance", "tablebase"};
+const char* tt_names[] = {"none", "miss", "shallow", "bound", "cutoff"};
+
+float percent(uint64_t a, uint64_t b) {
+    return b ? (float)a / (float)b * 100.0f : 0.0f;
+}
+
+void add_record(DepthStats& stats, const TraceRecord& record) {
+    stats.nodes++;
+    stats.moves_searched += record.moves_searched;
+    stats.beta_cutoffs += record.reason == TRACE_REASON_BETA_CUTOFF;
+    stats.first_move_cutoffs += record.reason == TRACE_REASON_BETA_CUTOFF && record.moves_searched == 1;
+    stats.tt_cutoffs += record.reason == TRACE_REASON_TT_CUTOFF;
+    stats.late_moves += record.late_moves;
+    stats.lmr_researches += record.lmr_researches;
+    stats.pv_late_moves += record.kind == TRACE_KIND_PV ? record.late_moves : 0;
+    stats.pvs_researches += record.pvs_researches;
+    stats.tt_stores += (record.tt & TRACE_TT_STORED) != 0;
+}
+
+void print_depth_stats(const char* label, const DepthStats& stats) {
+    printf(
+        "%6s %12lu %8.2f %8.1f%% %8.1f%% %8.1f%% %8.1f%% %8.1f%% %8.1f%%\n",
+        label,
+        stats.nodes,
+        stats.nodes ? (double)stats.moves_searched / (double)stats.nodes : 0.0,
+        percent(stats.beta_cutoffs, stats.nodes),
+        percent(stats.first_move_cutoffs, stats.beta_cutoffs),
+        percent(stats.tt_cutoffs, stats.nodes),
+        percent(stats.lmr_researches, stats.late_moves),
+        percent(stats.pvs_researches, stats.pv_late_moves),
+        percent(stats.tt_stores, stats.nodes)
+    );
+}
+
+int main(int argc, const char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open failed %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct stat sb;
+    fstat(fd, &sb);
+
+    const char* memblock = (const char*)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (memblock == MAP_FAILED) {
+        fprintf(stderr, "mmap failed %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    const TraceHeader* header = (const TraceHeader*)memblock;
+    if ((size_t)sb.st_size < sizeof(TraceHeader) || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION
+        || header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s is not a version %d trace\n", argv[1], TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    // the iteration state is per thread since chunks of different threads interleave
+    int* current_iteration = (int*)calloc(header->threads, sizeof(int));
+    uint64_t(*thread_iteration_nodes)[MAX_ITERATIONS] = (uint64_t(*)[MAX_ITERATIONS])calloc(header->threads, sizeof *thread_iteration_nodes);
+
+    // finishes the iteration that was running and adds its branching factor
+    auto close_iteration = [&](uint32_t thread) {
+        int iteration = current_iteration[thread];
+        if (iteration > 1 && thread_iteration_nodes[thread][iteration - 1] && thread_iteration_nodes[thread][iteration]) {
+            iteration_log_ebf[iteration] += log((double)thread_iteration_nodes[thread][iteration] / (double)thread_iteration_nodes[thread][iteration - 1]);
+            iteration_ebf_samples[iteration]++;
+        }
+    };
+
+    uint64_t searches = 0, total_records = 0;
+
+    size_t offset = sizeof(TraceHeader);
+    while (offset + sizeof(TraceChunk) <= (size_t)sb.st_size) {
+        const TraceChunk* chunk = (const TraceChunk*)(memblock + offset);
+        offset += sizeof(TraceChunk);
+
+        // a trace from a killed engine can end in the middle of a chunk
+        size_t count = chunk->count;
+        if (offset + count * sizeof(TraceRecord) > (size_t)sb.st_size) {
+            count = ((size_t)sb.st_size - offset) / sizeof(TraceRecord);
+        }
+        if (chunk->thread >= header->threads) {
+            fprintf(stderr, "corrupt chunk at offset %lu\n", offset);
+            break;
+        }
+
+        const TraceRecord* records = (const TraceRecord*)(memblock + offset);
+        for (size_t i = 0; i < count; i++) {
+            const TraceRecord& record = records[i];
+            uint32_t thread = chunk->thread;
+
+            if (record.kind == TRACE_KIND_ITERATION) {
+                // every search starts over at depth 1
+                if (record.depth <= 1) {
+                    // the last iteration of a search gets cut off by the clock, so it doesn't count
+                    memset(thread_iteration_nodes[thread], 0, sizeof *thread_iteration_nodes);
+                    searches++;
+                }
+                else {
+                    close_iteration(thread);
+                }
+                current_iteration[thread] = record.depth < 0                ? 0
+                                          : record.depth < MAX_ITERATIONS ? record.depth
+                                                                          : MAX_ITERATIONS - 1;
+                continue;
+            }
+
+            total_records++;
+            thread_iteration_nodes[thread][current_iteration[thread]]++;
+            iteration_nodes[current_iteration[thread]]++;
+
+            reasons[record.reason <= TRACE_REASON_TABLEBASE ? record.reason : (uint8_t)TRACE_REASON_ALL_MOVES]++;
+            tt_outcomes[(record.tt & TRACE_TT_PROBE_MASK) <= TRACE_TT_CUTOFF ? record.tt & TRACE_TT_PROBE_MASK : TRACE_TT_NONE]++;
+
+            if (record.kind == TRACE_KIND_QSEARCH) {
+                add_record(qsearch_stats, record);
+            }
+            else {
+                add_record(depth_stats[record.depth < 0 ? 0 : record.depth < MAX_DEPTH ? record.depth : MAX_DEPTH - 1], record);
+            }
+        }
+        offset += count * sizeof(TraceRecord);
+    }
+
+    printf("%lu nodes in %lu searches\n\n", total_records, searches);
+
+    printf("%6s %12s %8s %9s %9s %9s %9s %9s %9s\n", "depth", "nodes", "moves", "cutoffs", "1st move", "tt cuts", "lmr re", "pvs re", "tt store");
+    for (int depth = MAX_DEPTH - 1; depth >= 1; depth--) {
+        if (depth_stats[depth].nodes) {
+            char label[16];
+            snprintf(label, sizeof label, "%d", depth);
+            print_depth_stats(label, depth_stats[depth]);
+        }
+    }
+    print_depth_stats("qs", qsearch_stats);
+
+    printf("\n%9s %12s %12s\n", "iteration", "nodes", "ebf");
+    for (int iteration = 1; iteration < MAX_ITERATIONS; iteration++) {
+        if (!iteration_nodes[iteration]) {
+            continue;
+        }
+        if (iteration_ebf_samples[iteration]) {
+            // geometric mean, the ratios are multiplicative
+            printf("%9d %12lu %12.2f\n", iteration, iteration_nodes[iteration], exp(iteration_log_ebf[iteration] / (double)iteration_ebf_samples[iteration]));
+        }
+        else {
+            printf("%9d %12lu %12s\n", iteration, iteration_nodes[iteration], "-");
+        }
+    }
+
+    printf("\nreasons\n");
+    for (int i = 0; i <= TRACE_REASON_TABLEBASE; i++) {
+        printf("    %-12s %6.2f%%\n", reason_names[i], percent(reasons[i], total_records));
+    }
+    printf("tt probes\n");
+    for (int i = 0; i <= TRACE_TT_CUTOFF; i++) {
+        printf("    %-12s %6.2f%%\n", tt_names[i], percent(tt_outcomes[i], total_records));
+    }
+
+    free(current_iteration);
+    free(thread_iteration_nodes);
+    munmap((void*)memblock, sb.st_size);
+    close(fd);
+}
@@ -14,6 +14,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include "board.h"
+#include "eval_params.h"
 
 #define MAX_MOVES 256
 #define FETCH_MOVES(BOARD) \
@@ -304,25 +311,75 @@ char compressed_weights[1523] = {
     124,
 };
 
+// one input per color, piece type and square
 #define LAYER_1_PARAMS (64 * 6 * 2)
-#define LAYER_2_PARAMS (512)
-#define LAYER_3_PARAMS (512)
-#define LAYER_4_PARAMS (256)
-#define LAYER_5_PARAMS (1)
 
+// 64 bytes, a cache line and a whole AVX-512 register
+#define TENSOR_ALIGNMENT 64
+#define TENSOR_ROW_FLOATS (TENSOR_ALIGNMENT / (int)sizeof(float))
+
+// Owns every tensor of one trainer. They're carved out of a single zeroed block up front,
+// so a training step never allocates and two trainers never share a buffer.
+struct Arena {
+    char* base;
+    size_t size;
+    size_t used = 0;
+
+    explicit Arena(size_t size) : size(size) {
+        base = (char*)aligned_alloc(TENSOR_ALIGNMENT, size);
+        if (!base) {
+            fprintf(stderr, "allocating %zu bytes failed %s", size, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        memset(base, 0, size);
+    }
+    ~Arena() {
+        free(base);
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    float* allocate(size_t bytes) {
+        assert(bytes % TENSOR_ALIGNMENT == 0);
+        assert(used + bytes <= size);
+        float* data = (float*)(base + used);
+        used += bytes;
+        return data;
+    }
+};
+
+// A view of an N x M tensor in an Arena, copying it only copies the pointer. The rows are
+// stored one after another and padded to whole cache lines, with the batch as N every
+// position's values are contiguous and every row starts aligned for the vector units.
 template <int N, int M>
-struct Matrix {
-    float data[N * M];
+struct Tensor {
+    static constexpr int stride = (M + TENSOR_ROW_FLOATS - 1) / TENSOR_ROW_FLOATS * TENSOR_ROW_FLOATS;
+    static constexpr size_t bytes = (size_t)N * stride * sizeof(float);
 
+    float* data;
+
+    Tensor() : data(nullptr) {}
+    explicit Tensor(Arena& arena) : data(arena.allocate(bytes)) {}
+    // a view of memory that's already there, like the inference scratch
+    explicit Tensor(float* data) : data(data) {}
+
+    inline const float* row(int n) const {
+        assert(n >= 0 && n < N);
+        return (const float*)__builtin_assume_aligned(data + (size_t)n * stride, TENSOR_ALIGNMENT);
+    }
+    inline float* row(int n) {
+        assert(n >= 0 && n < N);
+        return (float*)__builtin_assume_aligned(data + (size_t)n * stride, TENSOR_ALIGNMENT);
+    }
     inline constexpr float at(int n, int m) const {
         assert(n >= 0 && n < N);
         assert(m >= 0 && m < M);
-        return data[n + m * N];
+        return data[(size_t)n * stride + m];
     }
     inline constexpr float& at(int n, int m) {
         assert(n >= 0 && n < N);
         assert(m >= 0 && m < M);
-        return data[n + m * N];
+        return data[(size_t)n * stride + m];
     }
     inline constexpr int getN() const {
         return N;
@@ -332,14 +389,19 @@ struct Matrix {
     }
 };
 
-Matrix<LAYER_1_PARAMS, LAYER_2_PARAMS> weights1;
-Matrix<LAYER_2_PARAMS, LAYER_3_PARAMS> weights2;
-Matrix<LAYER_3_PARAMS, LAYER_4_PARAMS> weights3;
-Matrix<LAYER_4_PARAMS, LAYER_5_PARAMS> weights4;
-Matrix<1, LAYER_2_PARAMS> biases1;
-Matrix<1, LAYER_3_PARAMS> biases2;
-Matrix<1, LAYER_4_PARAMS> biases3;
-Matrix<1, LAYER_5_PARAMS> biases4;
+// build with -DQAT for clipped ReLU layers trained against the integer inference below.
+// the forward pass rounds weights and activations to the same grid the integer code uses,
+// the gradients pass straight through the rounding and update the float weights
+#ifdef QAT
+    // the first layer's weights are int16 in units of 1/QA, the later layers' int8 in
+    // units of 1/QB. activations are uint8 in units of 1/QA
+    #define QA 127
+    #define QB 64
+
+    #define FORWARD(PARAMS) quantized_##PARAMS
+#else
+    #define FORWARD(PARAMS) PARAMS
+#endif
 
 
 /*
@@ -365,31 +427,78 @@ typedef struct {
     uint64_t bitboards[2][6];
     int stockfish_eval;
     bool is_white;
+    // of the Stockfish eval, capped at 255. it sits in what used to be padding, datasets
+    // preprocessed before it was stored have 0 there
+    uint8_t depth;
 } PreprocessedBoard;
 
+static_assert(sizeof(PreprocessedBoard) == 104, "the dataset format");
+
+// bitboards are indexed by PieceType - 1
+#define COUNT_PIECES(BOARD, PIECE) \
+    (__builtin_popcountl((BOARD).bitboards[WHITE][PIECE - 1]) - __builtin_popcountl((BOARD).bitboards[BLACK][PIECE - 1]))
+
 float ask_static_eval(PreprocessedBoard board) {
-    return (+(__builtin_popcountl(board.bitboards[WHITE][PAWN]) - __builtin_popcountl(board.bitboards[BLACK][PAWN])) * 100
-            + (__builtin_popcountl(board.bitboards[WHITE][KNIGHT]) - __builtin_popcountl(board.bitboards[BLACK][KNIGHT])) * 300
-            + (__builtin_popcountl(board.bitboards[WHITE][BISHOP]) - __builtin_popcountl(board.bitboards[BLACK][BISHOP])) * 320
-            + (__builtin_popcountl(board.bitboards[WHITE][ROOK]) - __builtin_popcountl(board.bitboards[BLACK][ROOK])) * 500
-            + (__builtin_popcountl(board.bitboards[WHITE][QUEEN]) - __builtin_popcountl(board.bitboards[BLACK][QUEEN])) * 900)
+    return (+COUNT_PIECES(board, PAWN) * EVAL_PAWN + COUNT_PIECES(board, KNIGHT) * EVAL_KNIGHT
+            + COUNT_PIECES(board, BISHOP) * EVAL_BISHOP + COUNT_PIECES(board, ROOK) * EVAL_ROOK
+            + COUNT_PIECES(board, QUEEN) * EVAL_QUEEN)
          * (board.is_white ? 1 : -1);
 }
 
+// output = a * b, a row of the output at a time so the inner loop runs along rows of b
+template <int N, int M, int O>
+void matrix_multiply(const Tensor<N, M> a, const Tensor<M, O> b, Tensor<N, O> output) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ out = output.row(x);
+        for (int y = 0; y < O; y++) {
+            out[y] = 0;
+        }
+        for (int i = 0; i < M; i++) {
+            const float a_xi = a.at(x, i);
+            const float* __restrict__ b_row = b.row(i);
+            for (int y = 0; y < O; y++) {
+                out[y] += a_xi * b_row[y];
+            }
+        }
+    }
+}
+// output = a^T * b without transposing a
 template <int N, int M, int O>
-void matrix_multiply(const Matrix<N, M>& __restrict__ a, const Matrix<M, O>& __restrict__ b, Matrix<N, O>& __restrict__ output) {
+void matrix_multiply_transposed_a(const Tensor<M, N> a, const Tensor<M, O> b, Tensor<N, O> output) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ out = output.row(x);
+        for (int y = 0; y < O; y++) {
+            out[y] = 0;
+        }
+        for (int i = 0; i < M; i++) {
+            const float a_ix = a.at(i, x);
+            const float* __restrict__ b_row = b.row(i);
+            for (int y = 0; y < O; y++) {
+                out[y] += a_ix * b_row[y];
+            }
+        }
+    }
+}
+// output = a * b^T without transposing b, every entry is a dot product of two rows
+template <int N, int M, int O>
+void matrix_multiply_transposed_b(const Tensor<N, M> a, const Tensor<O, M> b, Tensor<N, O> output) {
 #pragma omp parallel for collapse(2)
-    for (int y = 0; y < O; y++) {
-        for (int x = 0; x < N; x++) {
-            output.at(x, y) = 0;
+    for (int x = 0; x < N; x++) {
+        for (int y = 0; y < O; y++) {
+            const float* __restrict__ a_row = a.row(x);
+            const float* __restrict__ b_row = b.row(y);
+            float sum = 0;
             for (int i = 0; i < M; i++) {
-                output.at(x, y) += a.at(x, i) * b.at(i, y);
+                sum += a_row[i] * b_row[i];
             }
+            output.at(x, y) = sum;
         }
     }
 }
 template <int N, int M>
-void matrix_flatten(const Matrix<N, M>& __restrict__ a, Matrix<1, M>& __restrict__ b) {
+void matrix_flatten(const Tensor<N, M> a, Tensor<1, M> b) {
 #pragma omp parallel for
     for (int y = 0; y < M; y++) {
         b.at(0, y) = 0;
@@ -400,118 +509,194 @@ void matrix_flatten(const Matrix<N, M>& __restrict__ a, Matrix<1, M>& __restrict
 }
 // a *= b (elementwise)
 template <int N, int M>
-void matrix_fold_el(Matrix<N, M>& __restrict__ a, const Matrix<N, M>& __restrict__ b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) *= b.at(x, y);
+void matrix_fold_el(Tensor<N, M> a, const Tensor<N, M> b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] *= b_row[y];
         }
     }
 }
 template <int N, int M>
-void matrix_multiply_el(const Matrix<N, M>& __restrict__ a, const Matrix<N, M>& __restrict__ b, Matrix<N, M>& __restrict__ c) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            c.at(x, y) = a.at(x, y) * b.at(x, y);
+void matrix_multiply_el(const Tensor<N, M> a, const Tensor<N, M> b, Tensor<N, M> c) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        float* __restrict__ c_row = c.row(x);
+        for (int y = 0; y < M; y++) {
+            c_row[y] = a_row[y] * b_row[y];
         }
     }
 }
 template <int N, int M>
-void matrix_multiply_scalar_inplace(Matrix<N, M>& __restrict__ a, const float b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) *= b;
+void matrix_multiply_scalar_inplace(Tensor<N, M> a, const float b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] *= b;
         }
     }
 }
 template <int N, int M>
-void matrix_sign_inplace(Matrix<N, M>& __restrict__ a) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) = a.at(x, y) > 0 ? 1.0f : -1.0f;
+void matrix_sign_inplace(Tensor<N, M> a) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] = a_row[y] > 0 ? 1.0f : -1.0f;
         }
     }
 }
 
+template <int N, int M>
+void matrix_accumulate_thin(Tensor<N, M> a, const Tensor<1, M> b) {
+    const float* __restrict__ b_row = b.row(0);
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] += b_row[y];
+        }
+    }
+}
 
 template <int N, int M>
-void matrix_transpose(const Matrix<N, M>& __restrict__ a, Matrix<M, N>& __restrict__ b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            b.at(y, x) = a.at(x, y);
+void matrix_accumulate(Tensor<N, M> a, const Tensor<N, M> b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] += b_row[y];
+        }
+    }
+}
+// a += b * scale, the gradient step in one pass
+template <int N, int M>
+void matrix_accumulate_scaled(Tensor<N, M> a, const Tensor<N, M> b, const float scale) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] += b_row[y] * scale;
+        }
+    }
+}
+template <int N, int M>
+void matrix_reduce(Tensor<N, M> a, const Tensor<N, M> b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] -= b_row[y];
+        }
+    }
+}
+// c = a - b
+template <int N, int M>
+void matrix_difference(const Tensor<N, M> a, const Tensor<N, M> b, Tensor<N, M> c) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        const float* __restrict__ b_row = b.row(x);
+        float* __restrict__ c_row = c.row(x);
+        for (int y = 0; y < M; y++) {
+            c_row[y] = a_row[y] - b_row[y];
         }
     }
 }
 
 template <int N, int M>
-void matrix_accumulate_thin(Matrix<N, M>& __restrict__ a, const Matrix<1, M>& __restrict__ b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) += b.at(0, y);
+void matrix_activate_tanh(const Tensor<N, M> a, Tensor<N, M> b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            b_row[y] = tanhf(a_row[y]);
         }
     }
 }
 
+// grad *= tanh'(a)
 template <int N, int M>
-void matrix_accumulate(Matrix<N, M>& __restrict__ a, const Matrix<N, M>& __restrict__ b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) += b.at(x, y);
+void matrix_deactivate_tanh(const Tensor<N, M> a, Tensor<N, M> grad) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        float* __restrict__ grad_row = grad.row(x);
+        for (int y = 0; y < M; y++) {
+            float tanh = tanhf(a_row[y]);
+            grad_row[y] *= 1.0f - tanh * tanh;
         }
     }
 }
+
 template <int N, int M>
-void matrix_reduce(Matrix<N, M>& __restrict__ a, const Matrix<N, M>& __restrict__ b) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) -= b.at(x, y);
+void matrix_clamp_inplace(Tensor<N, M> a, const float min, const float max) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        float* __restrict__ a_row = a.row(x);
+        for (int y = 0; y < M; y++) {
+            a_row[y] = fminf(fmaxf(a_row[y], min), max);
         }
     }
 }
 
+// b = a rounded to multiples of 1 / scale, clamped to [min, max] multiples
 template <int N, int M>
-void matrix_activate_tanh(Matrix<N, M>& __restrict__ a) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) = tanhf(a.at(x, y));
+void matrix_fake_quantize(const Tensor<N, M> a, Tensor<N, M> b, const float scale, const float min, const float max) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            b_row[y] = fminf(fmaxf(roundf(a_row[y] * scale), min), max) / scale;
         }
     }
 }
 
+// b = a clamped to [0, 1], with -DQAT also rounded to the uint8 activations of the integer inference
 template <int N, int M>
-void matrix_deactivate_tanh(Matrix<N, M>& __restrict__ a) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            float tanh = tanhf(a.at(x, y));
-            a.at(x, y) = 1.0f - tanh * tanh;
+void matrix_activate_clipped_relu(const Tensor<N, M> a, Tensor<N, M> b) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        float* __restrict__ b_row = b.row(x);
+        for (int y = 0; y < M; y++) {
+            b_row[y] = fminf(fmaxf(a_row[y], 0.0f), 1.0f);
+#ifdef QAT
+            b_row[y] = roundf(b_row[y] * QA) / QA;
+#endif
         }
     }
 }
+
+// grad *= clipped_relu'(a)
 template <int N, int M>
-void matrix_deactivate_identity(Matrix<N, M>& __restrict__ a) {
-#pragma omp parallel for collapse(2)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
-            a.at(x, y) = 1;
+void matrix_deactivate_clipped_relu(const Tensor<N, M> a, Tensor<N, M> grad) {
+#pragma omp parallel for
+    for (int x = 0; x < N; x++) {
+        const float* __restrict__ a_row = a.row(x);
+        float* __restrict__ grad_row = grad.row(x);
+        for (int y = 0; y < M; y++) {
+            grad_row[y] *= a_row[y] > 0.0f && a_row[y] < 1.0f ? 1.0f : 0.0f;
         }
     }
 }
 
 template <int N, int M>
-float matrix_l2_loss(const Matrix<N, M>& __restrict__ prediction, const Matrix<N, M>& __restrict__ target) {
+float matrix_l2_loss(const Tensor<N, M> prediction, const Tensor<N, M> target) {
     float loss = 0;
 #pragma omp parallel for collapse(2) reduction(+ : loss)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
+    for (int x = 0; x < N; x++) {
+        for (int y = 0; y < M; y++) {
             float this_error = prediction.at(x, y) - target.at(x, y);
             loss += this_error * this_error;
         }
@@ -520,11 +705,11 @@ float matrix_l2_loss(const Matrix<N, M>& __restrict__ prediction, const Matrix<N
     return loss / (float)(N * M);
 }
 template <int N, int M>
-float matrix_l1_loss(const Matrix<N, M>& __restrict__ prediction, const Matrix<N, M>& __restrict__ target) {
+float matrix_l1_loss(const Tensor<N, M> prediction, const Tensor<N, M> target) {
     float loss = 0;
 #pragma omp parallel for collapse(2) reduction(+ : loss)
-    for (int y = 0; y < M; y++) {
-        for (int x = 0; x < N; x++) {
+    for (int x = 0; x < N; x++) {
+        for (int y = 0; y < M; y++) {
             float this_error = prediction.at(x, y) - target.at(x, y);
             loss += fabsf(this_error);
         }
@@ -534,7 +719,7 @@ float matrix_l1_loss(const Matrix<N, M>& __restrict__ prediction, const Matrix<N
 }
 
 template <int batch_size, int l1_params>
-void input_as_matrix(const PreprocessedBoard* __restrict__ boards, Matrix<batch_size, l1_params>& __restrict__ mat) {
+void input_as_matrix(const PreprocessedBoard* __restrict__ boards, Tensor<batch_size, l1_params> mat) {
 #pragma omp parallel for collapse(2)
     for (int b = 0; b < batch_size; b++) {
         for (int i = 0; i < l1_params; i++) {
@@ -545,193 +730,591 @@ void input_as_matrix(const PreprocessedBoard* __restrict__ boards, Matrix<batch_
     }
 }
 
-template <int batch_size, int l1_params, int l2_params, int l3_params, int l4_params, int l5_params>
-void pass_forwards(
-    const Matrix<batch_size, l1_params>& inputs,
-    Matrix<batch_size, l5_params>& predictions,
-    Matrix<batch_size, l2_params>& unactive_out1,
-    Matrix<batch_size, l3_params>& unactive_out2,
-    Matrix<batch_size, l4_params>& unactive_out3,
-    Matrix<batch_size, l5_params>& unactive_out4,
-    Matrix<batch_size, l2_params>& active_out1,
-    Matrix<batch_size, l3_params>& active_out2,
-    Matrix<batch_size, l4_params>& active_out3,
-    Matrix<batch_size, l5_params>& active_out4
-) {
-    static Matrix<batch_size, l2_params> output1;
-    matrix_multiply(inputs, weights1, output1);
-    matrix_accumulate_thin(output1, biases1);
-    unactive_out1 = output1;
-    matrix_activate_tanh(output1);
-    active_out1 = output1;
-
-    static Matrix<batch_size, l3_params> output2;
-    matrix_multiply(output1, weights2, output2);
-    matrix_accumulate_thin(output2, biases2);
-    unactive_out2 = output2;
-    matrix_activate_tanh(output2);
-    active_out2 = output2;
-
-    static Matrix<batch_size, l4_params> output3;
-    matrix_multiply(output2, weights3, output3);
-    matrix_accumulate_thin(output3, biases3);
-    unactive_out3 = output3;
-    matrix_activate_tanh(output3);
-    active_out3 = output3;
-
-    static Matrix<batch_size, l5_params> output4;
-    matrix_multiply(output3, weights4, output4);
-    matrix_accumulate_thin(output4, biases4);
-    unactive_out4 = output4;
-    matrix_activate_tanh(output4);
-    active_out4 = output4;
-
-    predictions = output4;
-}
-
-template <int batch_size, int input_params, int output_params>
-void pass_backwards_once(
-    Matrix<input_params, output_params> const& __restrict__ weights,
-    Matrix<batch_size, output_params> const& __restrict__ error,
-    Matrix<batch_size, input_params> const& __restrict__ activated_input,
-    Matrix<batch_size, output_params> const& __restrict__ output_grad,
-    Matrix<1, output_params>& __restrict__ bias_grad,
-    Matrix<input_params, output_params>& __restrict__ weight_grad,
-    Matrix<batch_size, input_params>& __restrict__ input_grad
-) {
-    static Matrix<input_params, batch_size> activated_input_trans;
-    static Matrix<batch_size, output_params> bias_grad_wide;
+enum Activation { TANH, CLIPPED_RELU, LINEAR };
+
+// a fully connected layer, its input size is the output size of the layer before it
+template <int OUTPUTS, Activation ACTIVATION>
+struct Dense {};
+
+template <Activation activation, int N, int M>
+void activate(const Tensor<N, M> sums, Tensor<N, M> active) {
+    if constexpr (activation == TANH) {
+        matrix_activate_tanh(sums, active);
+    }
+    else if constexpr (activation == CLIPPED_RELU) {
+        matrix_activate_clipped_relu(sums, active);
+    }
+    // a linear layer's activations are a view of its sums
+}
+
+// multiplies the gradient at the activations by the activation's derivative at the sums
+template <Activation activation, int N, int M>
+void deactivate(const Tensor<N, M> sums, Tensor<N, M> grad) {
+    if constexpr (activation == TANH) {
+        matrix_deactivate_tanh(sums, grad);
+    }
+    else if constexpr (activation == CLIPPED_RELU) {
+        matrix_deactivate_clipped_relu(sums, grad);
+    }
+}
+
+// single values, never rounded
+template <Activation activation>
+float activate_float(float x) {
+    if constexpr (activation == TANH) {
+        return tanhf(x);
+    }
+    else if constexpr (activation == CLIPPED_RELU) {
+        return fminf(fmaxf(x, 0.0f), 1.0f);
+    }
+    else {
+        return x;
+    }
+}
+
+#ifdef QAT
+    // a clipped ReLU only passes gradients between 0 and 1, keep the first sums in there
+    #define INIT_RANGE(FAN_IN) (1.0f / sqrtf((float)(FAN_IN)))
+#else
+    #define INIT_RANGE(FAN_IN) 1.0f
+#endif
+
+// A stack of layers like Network<batch_size, 768, Dense<512, TANH>, Dense<1, TANH>>. Every
+// level holds views of its layer's parameters and of the buffers a training step needs for
+// it, all carved out of one Arena of arena_bytes, and every kernel gets its shape at compile time.
+template <int batch_size, int inputs, typename... Layers>
+struct Network;
+
+#ifdef QAT
+template <int inputs, typename First, typename... Rest>
+struct QuantizedNetwork;
+#endif
+
+// past the output layer
+template <int batch_size, int inputs>
+struct Network<batch_size, inputs> {
+    static constexpr int outputs = inputs;
+    static constexpr size_t inference_bytes = 0;
+    static constexpr size_t arena_bytes = 0;
+    static constexpr int widest = 0;
+
+    explicit Network(Arena&, bool = true) {}
+
+    Tensor<batch_size, outputs> forward(const Tensor<batch_size, inputs> input) {
+        return input;
+    }
+
+    Tensor<batch_size, outputs> infer(const Tensor<batch_size, inputs> input, float*, float*) {
+        return input;
+    }
+
+    bool save(FILE*) const {
+        return true;
+    }
+    bool load(FILE*) {
+        return true;
+    }
+
+    void backward(const Tensor<batch_size, inputs>, Tensor<batch_size, inputs>*) {}
+
+    void update(float) {}
+};
+
+template <int batch_size, int inputs, int layer_outputs, Activation activation, typename... Rest>
+struct Network<batch_size, inputs, Dense<layer_outputs, activation>, Rest...> {
+    using Next = Network<batch_size, layer_outputs, Rest...>;
+    static constexpr int outputs = Next::outputs;
+    static constexpr bool is_output_layer = sizeof...(Rest) == 0;
+
+#ifdef QAT
+    // the float parameters and the rounded copies the forward pass uses
+    static constexpr int parameter_copies = 2;
+#else
+    static constexpr int parameter_copies = 1;
+#endif
+    static constexpr size_t parameter_bytes = Tensor<inputs, layer_outputs>::bytes + Tensor<1, layer_outputs>::bytes;
+    // for a net constructed without the training buffers
+    static constexpr size_t inference_bytes = parameter_copies * parameter_bytes + Next::inference_bytes;
+    // with the gradients and the activations of a batch
+    static constexpr size_t arena_bytes = (parameter_copies + 1) * parameter_bytes
+                                        + (activation == LINEAR ? 2 : 3) * Tensor<batch_size, layer_outputs>::bytes
+                                        + Next::arena_bytes;
+    // floats per row of infer's scratch buffers
+    static constexpr int widest = Tensor<1, layer_outputs>::stride > Next::widest ? Tensor<1, layer_outputs>::stride : Next::widest;
+    static constexpr size_t scratch_bytes = (size_t)batch_size * widest * sizeof(float);
+
+    Tensor<inputs, layer_outputs> weights;
+    Tensor<1, layer_outputs> biases;
+#ifdef QAT
+    // rounded to the integer grid, the forward pass uses these
+    Tensor<inputs, layer_outputs> quantized_weights;
+    Tensor<1, layer_outputs> quantized_biases;
+#endif
+
+    // the last batch before and after the activation, the same tensor for a linear layer
+    Tensor<batch_size, layer_outputs> unactive;
+    Tensor<batch_size, layer_outputs> active;
+
+    // the loss gradient at active, then at unactive
+    Tensor<batch_size, layer_outputs> delta;
+    Tensor<inputs, layer_outputs> weight_grad;
+    Tensor<1, layer_outputs> bias_grad;
+
+    Next next;
+
+#ifdef QAT
+    // the integer version, for the first layer
+    using Quantized = QuantizedNetwork<inputs, Dense<layer_outputs, activation>, Rest...>;
+#endif
+
+    // without training, only the parameters are allocated and only infer works
+    explicit Network(Arena& arena, bool training = true)
+        : weights(arena),
+          biases(arena),
+#ifdef QAT
+          quantized_weights(arena),
+          quantized_biases(arena),
+#endif
+          unactive(training ? Tensor<batch_size, layer_outputs>(arena) : Tensor<batch_size, layer_outputs>()),
+          active(activation == LINEAR || !training ? unactive : Tensor<batch_size, layer_outputs>(arena)),
+          delta(training ? Tensor<batch_size, layer_outputs>(arena) : Tensor<batch_size, layer_outputs>()),
+          weight_grad(training ? Tensor<inputs, layer_outputs>(arena) : Tensor<inputs, layer_outputs>()),
+          bias_grad(training ? Tensor<1, layer_outputs>(arena) : Tensor<1, layer_outputs>()),
+          next(arena, training) {
+    }
+
+    // the output layer starts at zero. seed is rand_r's state, nets built in parallel don't
+    // share one
+    void randomize(unsigned int* seed) {
+        if constexpr (!is_output_layer) {
+            for (int o = 0; o < layer_outputs; o++) {
+                for (int i = 0; i < inputs; i++) {
+                    weights.at(i, o) = (((float)rand_r(seed) / (float)RAND_MAX) * 2 - 1) * INIT_RANGE(inputs);
+                }
+            }
+            for (int o = 0; o < layer_outputs; o++) {
+                biases.at(0, o) = ((float)rand_r(seed) / (float)RAND_MAX) * 2 - 1;
+            }
+            next.randomize(seed);
+        }
+    }
+
+    // returns a view of the output layer's activations, valid until the next forward
+    Tensor<batch_size, outputs> forward(const Tensor<batch_size, inputs> input) {
+        matrix_multiply(input, FORWARD(weights), unactive);
+        matrix_accumulate_thin(unactive, FORWARD(biases));
+        activate<activation>(unactive, active);
+        return next.forward(active);
+    }
+
+    // the forward pass without keeping anything for backward. the layers take turns writing
+    // to the two scratch buffers of scratch_bytes, the result is a view of one of them
+    Tensor<batch_size, outputs> infer(const Tensor<batch_size, inputs> input, float* sums_scratch, float* active_scratch) {
+        Tensor<batch_size, layer_outputs> sums(sums_scratch);
+        matrix_multiply(input, FORWARD(weights), sums);
+        matrix_accumulate_thin(sums, FORWARD(biases));
+
+        if constexpr (activation == LINEAR) {
+            return next.infer(sums, active_scratch, sums_scratch);
+        }
+        else {
+            Tensor<batch_size, layer_outputs> activations(active_scratch);
+            activate<activation>(sums, activations);
+            return next.infer(activations, sums_scratch, active_scratch);
+        }
+    }
+
+    // the float weights and biases of every layer in order, without the row padding
+    bool save(FILE* out) const {
+        for (int i = 0; i < inputs; i++) {
+            if (fwrite(weights.row(i), sizeof(float), layer_outputs, out) != (size_t)layer_outputs) {
+                return false;
+            }
+        }
+        return fwrite(biases.row(0), sizeof(float), layer_outputs, out) == (size_t)layer_outputs && next.save(out);
+    }
+    bool load(FILE* in) {
+        for (int i = 0; i < inputs; i++) {
+            if (fread(weights.row(i), sizeof(float), layer_outputs, in) != (size_t)layer_outputs) {
+                return false;
+            }
+        }
+        return fread(biases.row(0), sizeof(float), layer_outputs, in) == (size_t)layer_outputs && next.load(in);
+    }
+
+    // where the loss gradient at the predictions goes before backward
+    Tensor<batch_size, outputs> output_grad() {
+        if constexpr (is_output_layer) {
+            return delta;
+        }
+        else {
+            return next.output_grad();
+        }
+    }
+
+    // takes the forward pass's input again. fills the parameter gradients and writes the
+    // gradient at the input to input_grad unless that's null
+    void backward(const Tensor<batch_size, inputs> input, Tensor<batch_size, inputs>* input_grad) {
+        next.backward(active, &delta);
+        deactivate<activation>(unactive, delta);
+
+        matrix_multiply_transposed_a(input, delta, weight_grad);
+        matrix_flatten(delta, bias_grad);
+
+        // nothing to pass back from the first layer
+        if (input_grad) {
+            matrix_multiply_transposed_b(delta, FORWARD(weights), *input_grad);
+        }
+    }
 
-    matrix_multiply_el(error, output_grad, bias_grad_wide);
+    // steps every layer's parameters by lr against the gradients of the last backward
+    void update(const float lr) {
+        matrix_accumulate_scaled(weights, weight_grad, -lr);
+        matrix_accumulate_scaled(biases, bias_grad, -lr);
+        next.update(lr);
+    }
+
+    // one position through the float parameters without any rounding, in units of the targets
+    float forward_float(const float* __restrict__ input) const {
+        float output[layer_outputs];
+        for (int o = 0; o < layer_outputs; o++) {
+            float sum = biases.at(0, o);
+            for (int i = 0; i < inputs; i++) {
+                sum += input[i] * weights.at(i, o);
+            }
+            output[o] = activate_float<activation>(sum);
+        }
+
+        if constexpr (is_output_layer) {
+            static_assert(layer_outputs == 1, "the net outputs a single eval");
+            return output[0];
+        }
+        else {
+            return next.forward_float(output);
+        }
+    }
 
-    matrix_transpose(activated_input, activated_input_trans);
-    matrix_multiply(activated_input_trans, bias_grad_wide, weight_grad);
-    matrix_flatten(bias_grad_wide, bias_grad);
+#ifdef QAT
+    // clamps the float parameters to what the integer types hold and refreshes the rounded
+    // copies. the first layer is int16 in units of 1/QA, the later ones int8 in units of 1/QB
+    void fake_quantize(bool first_layer = true) {
+        if (first_layer) {
+            matrix_clamp_inplace(weights, INT16_MIN / (float)QA, INT16_MAX / (float)QA);
+            matrix_fake_quantize(weights, quantized_weights, QA, INT16_MIN, INT16_MAX);
+            matrix_fake_quantize(biases, quantized_biases, QA, INT16_MIN, INT16_MAX);
+        }
+        else {
+            matrix_clamp_inplace(weights, INT8_MIN / (float)QB, INT8_MAX / (float)QB);
+            matrix_fake_quantize(weights, quantized_weights, QB, INT8_MIN, INT8_MAX);
+            matrix_fake_quantize(biases, quantized_biases, QA * QB, INT32_MIN, INT32_MAX);
+        }
 
-    static Matrix<output_params, input_params> weights_trans;
+        if constexpr (!is_output_layer) {
+            next.fake_quantize(false);
+        }
+    }
+#endif
+};
 
-    matrix_transpose(weights, weights_trans);
-    matrix_multiply(bias_grad_wide, weights_trans, input_grad);
+// the net being trained, one Dense per layer
+#ifdef QAT
+// the output stays linear, the integer inference returns the raw sum
+constexpr Activation hidden_activation = CLIPPED_RELU, output_activation = LINEAR;
+#else
+constexpr Activation hidden_activation = TANH, output_activation = TANH;
+#endif
+
+template <int batch_size>
+using Net = Network<
+    batch_size,
+    LAYER_1_PARAMS,
+    Dense<512, hidden_activation>,
+    Dense<512, hidden_activation>,
+    Dense<256, hidden_activation>,
+    Dense<1, output_activation>>;
+
+// a single hidden layer, for train_nn sweep to compare against
+template <int batch_size>
+using SmallNet = Network<batch_size, LAYER_1_PARAMS, Dense<256, hidden_activation>, Dense<1, output_activation>>;
+
+template <int batch_size, int input_params, typename... Layers>
+Tensor<batch_size, Network<batch_size, input_params, Layers...>::outputs> pass_forwards(
+    Network<batch_size, input_params, Layers...>& net,
+    const Tensor<batch_size, input_params> inputs
+) {
+    return net.forward(inputs);
 }
 
-template <int batch_size, int l1_params, int l2_params, int l3_params, int l4_params, int l5_params>
+template <int batch_size, int input_params, typename... Layers>
 void pass_backwards(
-    const float lr,
-    const Matrix<batch_size, l5_params>& __restrict__ predictions,
-    const Matrix<batch_size, l5_params>& __restrict__ targets,
-    const Matrix<batch_size, l1_params>& __restrict__ inputs,
-    Matrix<batch_size, l2_params>& __restrict__ unactive_out1,
-    Matrix<batch_size, l3_params>& __restrict__ unactive_out2,
-    Matrix<batch_size, l4_params>& __restrict__ unactive_out3,
-    Matrix<batch_size, l5_params>& __restrict__ unactive_out4,
-    const Matrix<batch_size, l2_params>& __restrict__ active_out1,
-    const Matrix<batch_size, l3_params>& __restrict__ active_out2,
-    const Matrix<batch_size, l4_params>& __restrict__ active_out3
+    Network<batch_size, input_params, Layers...>& net,
+    const Tensor<batch_size, Network<batch_size, input_params, Layers...>::outputs> predictions,
+    const Tensor<batch_size, Network<batch_size, input_params, Layers...>::outputs> targets,
+    const Tensor<batch_size, input_params> inputs
 ) {
-    static Matrix<batch_size, l5_params> y_hat_minus_y;
-    y_hat_minus_y = predictions;
+    // straight into the output layer's gradient buffer
+    Tensor<batch_size, Network<batch_size, input_params, Layers...>::outputs> y_hat_minus_y = net.output_grad();
 
-    // a -= b
-    matrix_reduce(y_hat_minus_y, targets);
+    matrix_difference(predictions, targets, y_hat_minus_y);
     // matrix_sign_inplace(y_hat_minus_y);
     matrix_multiply_scalar_inplace(y_hat_minus_y, 1.0f / (float)batch_size);
 
-    static Matrix<1, l5_params> bias_grad4;
-    static Matrix<l4_params, l5_params> weight_grad4;
-    static Matrix<batch_size, l4_params> delta3_wide;
+    net.backward(inputs, nullptr);
+}
+
+// the float parameters, independent of the batch size
+template <typename Network>
+void save_weights(const Network& net, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out || !net.save(out)) {
+        fprintf(stderr, "writing %s failed %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fclose(out);
+}
+
+template <typename Network>
+void load_weights(Network& net, const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (!in || !net.load(in) || fgetc(in) != EOF) {
+        fprintf(stderr, "%s isn't a net of this shape %s\n", path, in ? "" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+}
+
+#ifdef QAT
+// The integer version of a Network. The first layer is int16 and stored input-major so a
+// position only adds up the rows of its pieces, the later ones are int8 and output-major
+// for the dot products. The output layer returns its raw sum in units of 1/(QA * QB).
+template <int inputs, typename... Layers>
+struct QuantizedLayers {};
+
+template <int inputs, int layer_outputs, Activation activation, typename... Rest>
+struct QuantizedLayers<inputs, Dense<layer_outputs, activation>, Rest...> {
+    static constexpr bool is_output_layer = sizeof...(Rest) == 0;
+    static_assert(activation == (is_output_layer ? LINEAR : CLIPPED_RELU), "the integer net has clipped ReLU layers and a linear output");
+
+    int8_t weights[layer_outputs][inputs];
+    int32_t biases[layer_outputs];
+    QuantizedLayers<layer_outputs, Rest...> next;
+
+    // same rounding as matrix_fake_quantize, so the integer net is what was trained
+    template <typename Layer>
+    void quantize(const Layer& layer) {
+        for (int o = 0; o < layer_outputs; o++) {
+            for (int i = 0; i < inputs; i++) {
+                weights[o][i] = (int8_t)lroundf(layer.quantized_weights.at(i, o) * QB);
+            }
+            biases[o] = (int32_t)lroundf(layer.quantized_biases.at(0, o) * QA * QB);
+        }
+        if constexpr (!is_output_layer) {
+            next.quantize(layer.next);
+        }
+    }
 
-    matrix_deactivate_tanh(unactive_out4);
-    pass_backwards_once(weights4, y_hat_minus_y, active_out3, unactive_out4, bias_grad4, weight_grad4, delta3_wide);
+    int32_t forward(const uint8_t* __restrict__ input) const {
+        int32_t sums[layer_outputs];
+        for (int o = 0; o < layer_outputs; o++) {
+            sums[o] = biases[o];
+            for (int i = 0; i < inputs; i++) {
+                sums[o] += input[i] * weights[o][i];
+            }
+        }
 
-    static Matrix<1, l4_params> bias_grad3;
-    static Matrix<l3_params, l4_params> weight_grad3;
-    static Matrix<batch_size, l3_params> delta2_wide;
+        if constexpr (is_output_layer) {
+            return sums[0];
+        }
+        else {
+            // back down to units of 1/QA before clipping
+            static_assert(QB == 1 << 6, "shifts by log2(QB)");
+            uint8_t output[layer_outputs];
+            for (int o = 0; o < layer_outputs; o++) {
+                int32_t sum = (sums[o] + QB / 2) >> 6;
+                output[o] = (uint8_t)(sum < 0 ? 0 : sum > QA ? QA : sum);
+            }
+            return next.forward(output);
+        }
+    }
+};
 
-    matrix_deactivate_tanh(unactive_out3);
-    pass_backwards_once(weights3, delta3_wide, active_out2, unactive_out3, bias_grad3, weight_grad3, delta2_wide);
+template <int inputs, int layer_outputs, Activation activation, typename... Rest>
+struct QuantizedNetwork<inputs, Dense<layer_outputs, activation>, Rest...> {
+    static_assert(inputs == LAYER_1_PARAMS, "the first layer reads the position");
+    static_assert(activation == CLIPPED_RELU && sizeof...(Rest) > 0, "the integer net starts with a clipped ReLU layer");
+
+    int16_t weights[inputs][layer_outputs];
+    int16_t biases[layer_outputs];
+    // the inputs are -1 or 1, so the accumulator starts from the bias with every input at
+    // -1 and a position adds twice the rows of its pieces
+    int32_t accumulator_base[layer_outputs];
+    QuantizedLayers<layer_outputs, Rest...> next;
+
+    template <typename Net>
+    void quantize(const Net& net) {
+        for (int i = 0; i < inputs; i++) {
+            for (int o = 0; o < layer_outputs; o++) {
+                weights[i][o] = (int16_t)lroundf(net.quantized_weights.at(i, o) * QA);
+            }
+        }
+        for (int o = 0; o < layer_outputs; o++) {
+            biases[o] = (int16_t)lroundf(net.quantized_biases.at(0, o) * QA);
+            accumulator_base[o] = biases[o];
+            for (int i = 0; i < inputs; i++) {
+                accumulator_base[o] -= weights[i][o];
+            }
+        }
+        next.quantize(net.next);
+    }
 
-    static Matrix<1, l3_params> bias_grad2;
-    static Matrix<l2_params, l3_params> weight_grad2;
-    static Matrix<batch_size, l2_params> delta1_wide;
+    // in centipawns, same orientation as the training targets
+    float forward(const PreprocessedBoard& board) const {
+        int32_t accumulator[layer_outputs];
+        memcpy(accumulator, accumulator_base, sizeof accumulator);
+        for (int color = 0; color < 2; color++) {
+            for (int piece = 0; piece < 6; piece++) {
+                for (uint64_t pieces = board.bitboards[color][piece]; pieces; pieces &= pieces - 1) {
+                    // the input order of input_as_matrix
+                    int i = __builtin_ctzll(pieces) * 6 * 2 + piece * 2 + color;
+                    for (int o = 0; o < layer_outputs; o++) {
+                        accumulator[o] += 2 * weights[i][o];
+                    }
+                }
+            }
+        }
 
-    matrix_deactivate_tanh(unactive_out2);
-    pass_backwards_once(weights2, delta2_wide, active_out1, unactive_out2, bias_grad2, weight_grad2, delta1_wide);
+        uint8_t active[layer_outputs];
+        for (int o = 0; o < layer_outputs; o++) {
+            active[o] = (uint8_t)(accumulator[o] < 0 ? 0 : accumulator[o] > QA ? QA : accumulator[o]);
+        }
+        return (float)next.forward(active) / (QA * QB) * 2000.0f;
+    }
+};
 
-    static Matrix<1, l2_params> bias_grad1;
-    static Matrix<l1_params, l2_params> weight_grad1;
-    static Matrix<batch_size, l1_params> delta0_wide;
+// compares the integer net with the float one on positions it wasn't trained on
+template <typename Network, typename Quantized>
+void validate_quantized(const Network& net, const Quantized& quantized, const PreprocessedBoard* boards, size_t num_boards) {
+    double quantized_diff = 0, float_diff = 0, quantization_error = 0, max_quantization_error = 0;
 
-    matrix_deactivate_tanh(unactive_out1);
-    pass_backwards_once(weights1, delta1_wide, inputs, unactive_out1, bias_grad1, weight_grad1, delta0_wide);
+#pragma omp parallel for reduction(+ : quantized_diff, float_diff, quantization_error) reduction(max : max_quantization_error)
+    for (size_t b = 0; b < num_boards; b++) {
+        float inputs[LAYER_1_PARAMS];
+        for (int i = 0; i < LAYER_1_PARAMS; i++) {
+            inputs[i] = (boards[b].bitboards[i % 2][i / 2 % 6] >> (i / (6 * 2)) & 0b1) ? 1.0f : -1.0f;
+        }
 
-    // update
-    const float step_size = lr;
+        float target = boards[b].stockfish_eval * (boards[b].is_white ? 1.0f : -1.0f);
+        float integer = quantized.forward(boards[b]), unrounded = net.forward_float(inputs) * 2000.0f;
 
-    matrix_multiply_scalar_inplace(weight_grad1, -step_size);
-    matrix_accumulate(weights1, weight_grad1);
-    matrix_multiply_scalar_inplace(weight_grad2, -step_size);
-    matrix_accumulate(weights2, weight_grad2);
-    matrix_multiply_scalar_inplace(weight_grad3, -step_size);
-    matrix_accumulate(weights3, weight_grad3);
-    matrix_multiply_scalar_inplace(weight_grad4, -step_size);
-    matrix_accumulate(weights4, weight_grad4);
+        quantized_diff += fabsf(integer - target);
+        float_diff += fabsf(unrounded - target);
+        quantization_error += fabsf(integer - unrounded);
+        max_quantization_error = fmax(max_quantization_error, fabsf(integer - unrounded));
+    }
 
-    matrix_multiply_scalar_inplace(bias_grad1, -step_size);
-    matrix_accumulate(biases1, bias_grad1);
-    matrix_multiply_scalar_inplace(bias_grad2, -step_size);
-    matrix_accumulate(biases2, bias_grad2);
-    matrix_multiply_scalar_inplace(bias_grad3, -step_size);
-    matrix_accumulate(biases3, bias_grad3);
-    matrix_multiply_scalar_inplace(bias_grad4, -step_size);
-    matrix_accumulate(biases4, bias_grad4);
+    printf(
+        "[Validation] Quantized: ±%.2f | Float: ±%.2f | Quantization error: ±%.2f (max %.2f)\n",
+        quantized_diff / (double)num_boards,
+        float_diff / (double)num_boards,
+        quantization_error / (double)num_boards,
+        max_quantization_error
+    );
 }
 
+template <typename Quantized>
+void save_quantized(const Quantized& quantized, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out || fwrite(&quantized, sizeof quantized, 1, out) != 1) {
+        fprintf(stderr, "writing %s failed %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fclose(out);
+}
+#endif
 
-PreprocessedBoard preprocess_fen(char* fen) {
+// false for a FEN libchess can't parse, pp_board is left as it was
+bool preprocess_fen(const char* fen, PreprocessedBoard* pp_board) {
     Board* board = chess_board_from_fen(fen);
+    if (!board) {
+        return false;
+    }
 
-    PreprocessedBoard pp_board = {};
+    *pp_board = {};
 
 
     for (int color = 0; color < 2; color++) {
         for (int piece = 0; piece < 6; piece++) {
             for (int i = 0; i < 64; i++) {
-                pp_board.bitboards[color][piece] = chess_get_bitboard(board, (PlayerColor)color, (PieceType)(piece + 1));
+                pp_board->bitboards[color][piece] = chess_get_bitboard(board, (PlayerColor)color, (PieceType)(piece + 1));
             }
         }
     }
 
-    pp_board.is_white = chess_is_white_turn(board);
+    pp_board->is_white = chess_is_white_turn(board);
 
     chess_free_board(board);
 
-    return pp_board;
+    return true;
 }
 
-size_t process_all_boards(char* string, PreprocessedBoard* boards, size_t board_size) {
+// boards go out in chunks as they're parsed, a whole dump of them doesn't fit in memory
+#define PREPROCESS_CHUNK_BOARDS 65536
+
+size_t process_all_boards(char* string, FILE* out) {
+    static PreprocessedBoard chunk[PREPROCESS_CHUNK_BOARDS];
+    size_t len_chunk = 0;
+
     char* buffer = strtok(string, "\n");
 
-    size_t num_boards = 0;
+    size_t num_boards = 0, invalid = 0;
 
-    do {
-        PreprocessedBoard board = preprocess_fen(buffer);
+    while (buffer) {
+        char* fen = buffer;
 
-        buffer = strtok(NULL, "\n");
+        // a cut off record at the end
+        if (!(buffer = strtok(NULL, "\n"))) {
+            break;
+        }
         int depth = atoi(buffer);
+        if (!(buffer = strtok(NULL, "\n"))) {
+            break;
+        }
 
-        buffer = strtok(NULL, "\n");
+        PreprocessedBoard board;
+        if (!preprocess_fen(fen, &board)) {
+            fprintf(stderr, "skipping invalid FEN %s\n", fen);
+            invalid++;
+            buffer = strtok(NULL, "\n");
+            continue;
+        }
         board.stockfish_eval = atoi(buffer);
+        board.depth = (uint8_t)(depth < 0 ? 0 : depth > UINT8_MAX ? UINT8_MAX : depth);
 
         if (num_boards % 1'000'000 == 0) {
             printf("Processed first %lu boards\n", num_boards);
         }
 
-        if (depth >= 15) {
-            boards[num_boards++] = board;
+        // filtered by train_nn index
+        chunk[len_chunk++] = board;
+        num_boards++;
+        if (len_chunk == PREPROCESS_CHUNK_BOARDS) {
+            if (fwrite(chunk, sizeof *chunk, len_chunk, out) != len_chunk) {
+                perror("write failed");
+                exit(EXIT_FAILURE);
+            }
+            len_chunk = 0;
         }
 
-    } while ((buffer = strtok(NULL, "\n")) && num_boards < board_size);
+        buffer = strtok(NULL, "\n");
+    }
 
+    if (fwrite(chunk, sizeof *chunk, len_chunk, out) != len_chunk) {
+        perror("write failed");
+        exit(EXIT_FAILURE);
+    }
+    if (invalid) {
+        printf("Skipped %zu records with an invalid FEN\n", invalid);
+    }
     return num_boards;
 }
 
@@ -743,120 +1326,736 @@ typedef struct {
 } FileFormat;
 }
 
-int compareBoard(void const* b1, void const* b2) {
-    return ((PreprocessedBoard*)b1)->stockfish_eval - ((PreprocessedBoard*)b2)->stockfish_eval;
-}
-
-int main(int argc, const char** argv) {
-    if (argc >= 2 && !strcmp(argv[1], "preprocess")) {
-        int fd = open("lichess_db_eval_processed.raw", O_RDONLY);
-        struct stat sb;
-        fstat(fd, &sb);
-        printf("Size: %lu\n", (uint64_t)sb.st_size);
-
-        const size_t fen_buffer_space = 5;
+// How map_dataset brings the dataset in, from TRAIN_NN_DATASET:
+//  map       (default) a read-only mapping of the file, paged in on first use
+//  populate  the same but read in completely up front
+//  numa      an anonymous copy, every shard written by the thread that works on it with
+//            schedule(static), so with OMP_PROC_BIND=spread it sits on that thread's node.
+//            the passes in file order use that split, the trainer reads its shuffled
+//            batches through gather_batch so every thread still only reads its own shard
+//  huge      numa on transparent huge pages
+// None of them keep more than one copy, the file's page cache is dropped after copying.
+#define HUGE_PAGE_SIZE (2ull << 20)
+
+// maps the output of train_nn preprocess. advice is MADV_SEQUENTIAL for passes in file order
+// and MADV_RANDOM for shuffled access
+const FileFormat* map_dataset(int advice) {
+    const char* mode = getenv("TRAIN_NN_DATASET");
+    bool populate = mode && !strcmp(mode, "populate");
+    bool huge = mode && !strcmp(mode, "huge");
+    bool copy = huge || (mode && !strcmp(mode, "numa"));
+    if (mode && !populate && !copy && strcmp(mode, "map")) {
+        fprintf(stderr, "TRAIN_NN_DATASET is map, populate, numa or huge, not %s\n", mode);
+        exit(EXIT_FAILURE);
+    }
 
-        char* memblock = (char*)mmap(NULL, sb.st_size + fen_buffer_space, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-        if (memblock == MAP_FAILED) {
-            fprintf(stderr, "mmap failed %s", strerror(errno));
-            exit(EXIT_FAILURE);
+    int fd = open("lichess_db_eval_processed.bin", O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct stat sb;
+    fstat(fd, &sb);
+    printf("Size: %lu\n", (uint64_t)sb.st_size);
+
+    // the copy reads the file front to back whatever the advice is
+    FileFormat* file = (FileFormat*)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+    if (file == MAP_FAILED) {
+        fprintf(stderr, "mmap failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    madvise(file, sb.st_size, copy ? MADV_SEQUENTIAL : advice);
+    if (!copy) {
+        // shuffled passes still touch every board, so read it all in the background
+        if (advice == MADV_RANDOM && !populate) {
+            madvise(file, sb.st_size, MADV_WILLNEED);
         }
+        close(fd);
+        return file;
+    }
 
-        memset(memblock + sb.st_size, ' ', fen_buffer_space);
-
-        memblock[sb.st_size + fen_buffer_space - 1] = '\0';
+    // over-allocated so the copy starts on a huge page boundary
+    size_t size = (sb.st_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    char* memory = (char*)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "mmap failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    FileFormat* data = (FileFormat*)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (huge && madvise(data, size, MADV_HUGEPAGE)) {
+        perror("madvise MADV_HUGEPAGE");
+    }
 
-        // segfaults if we process all of them
-        size_t max_boards = 71'000'000;
+    if (!getenv("OMP_PROC_BIND")) {
+        printf("OMP_PROC_BIND isn't set, the threads may leave the node their shard is on\n");
+    }
 
-        FileFormat* file = (FileFormat*)malloc(sizeof(FileFormat) + max_boards * sizeof(PreprocessedBoard));
+    // the same static split over the boards as the passes over the dataset
+    data->num_boards = file->num_boards;
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < file->num_boards; i++) {
+        data->boards[i] = file->boards[i];
+    }
 
-        file->num_boards = process_all_boards(memblock, file->boards, max_boards);
+    munmap(file, sb.st_size);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
 
-        printf("Processing done\n");
+    printf("Copied the dataset%s\n", huge ? " to huge pages" : "");
+    return data;
+}
 
-        int outfile = open("lichess_db_eval_processed.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (outfile < 0) {
-            fprintf(stderr, "open failed %s", strerror(errno));
-            exit(EXIT_FAILURE);
+// copies the boards at indices into batch. every thread takes the ones in its schedule(static)
+// shard of the dataset, the first num_boards % threads threads one board more like libgomp and
+// libomp split it, so with the numa and huge modes the reads of a shuffled batch stay local
+void gather_batch(const FileFormat* data, const uint32_t* __restrict__ indices, PreprocessedBoard* __restrict__ batch, int len) {
+#pragma omp parallel
+    {
+        size_t threads = omp_get_num_threads(), thread = omp_get_thread_num();
+        size_t shard = data->num_boards / threads, rest = data->num_boards % threads;
+        size_t begin = thread * shard + (thread < rest ? thread : rest);
+        size_t end = begin + shard + (thread < rest);
+
+        for (int j = 0; j < len; j++) {
+            if (indices[j] >= begin && indices[j] < end) {
+                batch[j] = data->boards[indices[j]];
+            }
         }
+    }
+}
 
-        size_t bytes_to_write = sizeof(FileFormat) + file->num_boards * sizeof(PreprocessedBoard);
+// The positions a training run uses, as indices into the dataset. train_nn index builds it
+// with duplicates removed and the filters applied, the trainer maps it and shuffles the
+// indices instead of the boards. Changing the filters doesn't touch the dataset.
+#define INDEX_PATH "lichess_db_eval_processed.idx"
 
-        printf("Writing %lu bytes\n", bytes_to_write);
-        char* ptr = (char*)file;
-        while (bytes_to_write > 0) {
-            ssize_t n = write(outfile, ptr, bytes_to_write);
-            if (n < 0) {
-                perror("write failed");
-                exit(EXIT_FAILURE);
+typedef struct {
+    uint64_t dataset_boards; // num_boards of the dataset it was built for
+    uint64_t num_indices;
+    uint32_t indices[];
+} DatasetIndex;
+
+typedef struct {
+    int min_depth;     // boards without a depth always pass
+    int max_eval;      // absolute, in centipawns
+    int min_pieces;    // kings included
+    int max_pieces;
+    bool skip_in_check;
+} IndexFilters;
+
+// train_nn index without options, and what training falls back to without an index file
+constexpr IndexFilters DEFAULT_INDEX_FILTERS = {
+    .min_depth = 15,
+    .max_eval = INT_MAX,
+    .min_pieces = 0,
+    .max_pieces = 32,
+    .skip_in_check = false,
+};
+
+// board.h's view of a packed board, castling rights and en passant aren't stored
+Position position_from_preprocessed(const PreprocessedBoard& board) {
+    Position pos = {};
+    for (int color = 0; color < 2; color++) {
+        for (int piece = 0; piece < 6; piece++) {
+            uint64_t pieces = board.bitboards[color][piece];
+            pos.by_color[color] |= pieces;
+            pos.by_type[piece + 1] |= pieces;
+            while (pieces) {
+                pos.mailbox[pop_square(&pieces)] = piece + 1;
             }
-            ptr += n;
-            bytes_to_write -= n;
         }
-        printf("Done\n");
+    }
+    pos.side = board.is_white ? WHITE : BLACK;
+    pos.ep_square = NO_SQUARE;
+    pos.key = position_zobrist_key(&pos);
+    return pos;
+}
 
-        close(outfile);
+// packs the eval depth above the index, so the largest value of a key is its deepest eval
+// and of those the earliest one
+#define INDEX_BITS 40
+#define PACK_INDEX(DEPTH, INDEX) ((uint64_t)(DEPTH) << INDEX_BITS | (((1ull << INDEX_BITS) - 1) - (INDEX)))
+#define UNPACK_INDEX(PACKED) (((1ull << INDEX_BITS) - 1) - ((PACKED) & ((1ull << INDEX_BITS) - 1)))
+
+// open addressing, keys are never removed. 0 marks an empty slot, so no key may be 0
+void index_insert(uint64_t* __restrict__ keys, uint64_t* __restrict__ values, uint64_t mask, uint64_t key, uint64_t value) {
+    for (uint64_t slot = key & mask;; slot = (slot + 1) & mask) {
+        uint64_t found = __atomic_load_n(&keys[slot], __ATOMIC_RELAXED);
+        if (!found) {
+            uint64_t empty = 0;
+            if (__atomic_compare_exchange_n(&keys[slot], &empty, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                found = key;
+            }
+            else {
+                found = empty;
+            }
+        }
+        if (found != key) {
+            continue;
+        }
 
-        free(file);
+        uint64_t current = __atomic_load_n(&values[slot], __ATOMIC_RELAXED);
+        while (current < value
+               && !__atomic_compare_exchange_n(&values[slot], &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        return;
     }
-    else {
-        int fd = open("lichess_db_eval_processed.bin", O_RDONLY);
-        if (fd < 0) {
-            fprintf(stderr, "open failed %s", strerror(errno));
-            exit(EXIT_FAILURE);
+}
+
+// the boards passing the filters, deduplicated and in dataset order
+DatasetIndex* filter_dataset(const FileFormat* data, const IndexFilters& filters) {
+    if (data->num_boards > UINT32_MAX) {
+        fprintf(stderr, "%zu boards don't fit the 32 bit indices\n", data->num_boards);
+        exit(EXIT_FAILURE);
+    }
+
+    board_init();
+
+    // at most half full
+    uint64_t slots = 1;
+    while (slots < 2 * data->num_boards) {
+        slots *= 2;
+    }
+    uint64_t* keys = (uint64_t*)calloc(slots, sizeof *keys);
+    uint64_t* values = (uint64_t*)calloc(slots, sizeof *values);
+    if (!keys || !values) {
+        fprintf(stderr, "allocating the hash set failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    size_t too_shallow = 0, out_of_range = 0, wrong_pieces = 0, in_check = 0, passed = 0;
+
+#pragma omp parallel for schedule(static) reduction(+ : too_shallow, out_of_range, wrong_pieces, in_check, passed)
+    for (size_t i = 0; i < data->num_boards; i++) {
+        const PreprocessedBoard& board = data->boards[i];
+
+        int pieces = 0;
+        for (int color = 0; color < 2; color++) {
+            for (int piece = 0; piece < 6; piece++) {
+                pieces += __builtin_popcountll(board.bitboards[color][piece]);
+            }
         }
-        struct stat sb;
-        fstat(fd, &sb);
-        printf("Size: %lu\n", (uint64_t)sb.st_size);
 
-        FileFormat* all_boards = (FileFormat*)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-        if (all_boards == MAP_FAILED) {
-            fprintf(stderr, "mmap failed %s", strerror(errno));
-            exit(EXIT_FAILURE);
+        if (board.depth && board.depth < filters.min_depth) {
+            too_shallow++;
+            continue;
+        }
+        if (abs(board.stockfish_eval) > filters.max_eval) {
+            out_of_range++;
+            continue;
+        }
+        if (pieces < filters.min_pieces || pieces > filters.max_pieces) {
+            wrong_pieces++;
+            continue;
         }
 
-        // decompress_weights(compressed_weights);
+        Position pos = position_from_preprocessed(board);
+        if (filters.skip_in_check && PIECES(&pos, pos.side, KING) && position_in_check(&pos)) {
+            in_check++;
+            continue;
+        }
 
+        index_insert(keys, values, slots - 1, pos.key ? pos.key : 1, PACK_INDEX(board.depth, i));
+        passed++;
+    }
 
-        for (int i = 0; i < weights1.getN(); i++) {
-            for (int j = 0; j < weights1.getM(); j++) {
-                weights1.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
-            }
+    // back in dataset order, so a pass over the index reads the file front to back
+    bool* keep = (bool*)calloc(data->num_boards, sizeof *keep);
+#pragma omp parallel for
+    for (uint64_t slot = 0; slot < slots; slot++) {
+        if (keys[slot]) {
+            keep[UNPACK_INDEX(values[slot])] = true;
         }
-        for (int i = 0; i < weights2.getN(); i++) {
-            for (int j = 0; j < weights2.getM(); j++) {
-                weights2.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
-            }
+    }
+    free(keys);
+    free(values);
+
+    DatasetIndex* index = (DatasetIndex*)malloc(sizeof(DatasetIndex) + passed * sizeof(uint32_t));
+    index->dataset_boards = data->num_boards;
+    index->num_indices = 0;
+    for (size_t i = 0; i < data->num_boards; i++) {
+        if (keep[i]) {
+            index->indices[index->num_indices++] = (uint32_t)i;
         }
-        for (int i = 0; i < weights3.getN(); i++) {
-            for (int j = 0; j < weights3.getM(); j++) {
-                weights3.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
-            }
+    }
+    free(keep);
+
+    printf(
+        "%zu boards: %zu too shallow, %zu out of the eval range, %zu with the wrong piece count, %zu in check, "
+        "%zu duplicates\n",
+        data->num_boards,
+        too_shallow,
+        out_of_range,
+        wrong_pieces,
+        in_check,
+        passed - index->num_indices
+    );
+    return index;
+}
+
+void build_index(const IndexFilters& filters, const char* out_path) {
+    const FileFormat* data = map_dataset(MADV_SEQUENTIAL);
+    DatasetIndex* index = filter_dataset(data, filters);
+
+    FILE* out = fopen(out_path, "wb");
+    if (!out || fwrite(index, sizeof(DatasetIndex) + index->num_indices * sizeof(uint32_t), 1, out) != 1) {
+        fprintf(stderr, "writing %s failed %s", out_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fclose(out);
+    printf("Wrote %zu indices to %s\n", (size_t)index->num_indices, out_path);
+
+    free(index);
+}
+
+// writable, the trainer shuffles it. without an index file the default filters are applied
+// in memory, the dataset itself has every board the preprocessing read
+DatasetIndex* map_index(const FileFormat* data) {
+    int fd = open(INDEX_PATH, O_RDONLY);
+    if (fd < 0) {
+        printf("No %s, filtering with the defaults of train_nn index\n", INDEX_PATH);
+        return filter_dataset(data, DEFAULT_INDEX_FILTERS);
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+    DatasetIndex* index = (DatasetIndex*)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (index == MAP_FAILED) {
+        fprintf(stderr, "mmap failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (index->dataset_boards != data->num_boards
+        || (size_t)sb.st_size != sizeof(DatasetIndex) + index->num_indices * sizeof(uint32_t)) {
+        fprintf(stderr, "%s was built for another dataset, rebuild it with train_nn index\n", INDEX_PATH);
+        exit(EXIT_FAILURE);
+    }
+    printf("Training on %zu of %zu boards\n", (size_t)index->num_indices, data->num_boards);
+    return index;
+}
+
+// Texel tuning of the hand-written eval (eval_params.h) against the Stockfish evals.
+// The eval is linear in its weights once the mop-up condition is fixed, so every position
+// boils down to a short list of (weight, coefficient) features. Both the eval and the
+// target go through a sigmoid before comparing them, a +2000 position shouldn't pull
+// the weights ten times harder than a +200 one.
+
+typedef struct {
+    float material[6]; // indexed by PieceType - 1, the king's stays 0
+    float pst[6][64];  // square from the piece's side
+    float mopup_offset, mopup_center, mopup_distance;
+    float isolated_pawn, doubled_pawn;
+    float passed_pawn[8];
+} EvalParams;
+
+constexpr int NUM_EVAL_PARAMS = sizeof(EvalParams) / sizeof(float);
+#define PARAM_INDEX(FIELD) (uint16_t)(offsetof(EvalParams, FIELD) / sizeof(float))
+
+typedef struct {
+    uint16_t index;
+    float value;
+} EvalFeature;
+
+// 5 material, 32 pst, 3 mopup, 2 + 6 pawn structure
+#define MAX_EVAL_FEATURES 64
+
+// lichess win probability scale, 400cp is 10:1
+#define EVAL_SIGMOID_SCALE (2.302585f / 400.0f)
+
+float win_probability(float eval) {
+    return 1.0f / (1.0f + expf(-eval * EVAL_SIGMOID_SCALE));
+}
+
+// white relative, mirrors static_eval_me and pawn_structure_eval in thera_mini.c
+int eval_features(const PreprocessedBoard& board, const EvalParams& params, EvalFeature* __restrict__ features) {
+    int len = 0;
+
+    float material[2] = {0, 0};
+    int non_pawns = 0;
+    for (int piece = 0; piece < 6; piece++) {
+        int white = __builtin_popcountll(board.bitboards[WHITE][piece]);
+        int black = __builtin_popcountll(board.bitboards[BLACK][piece]);
+        if (white != black && piece != KING - 1) {
+            features[len++] = {(uint16_t)(PARAM_INDEX(material) + piece), (float)(white - black)};
         }
-        for (int i = 0; i < biases1.getN(); i++) {
-            for (int j = 0; j < biases1.getM(); j++) {
-                biases1.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
+        material[WHITE] += white * params.material[piece];
+        material[BLACK] += black * params.material[piece];
+        non_pawns += piece == PAWN - 1 ? 0 : white + black;
+
+        for (int color = 0; color < 2; color++) {
+            for (uint64_t pieces = board.bitboards[color][piece]; pieces; pieces &= pieces - 1) {
+                int square = __builtin_ctzll(pieces) ^ (color == WHITE ? 0 : 56);
+                features[len++] = {(uint16_t)(PARAM_INDEX(pst) + piece * 64 + square), color == WHITE ? 1.0f : -1.0f};
             }
         }
-        for (int i = 0; i < biases2.getN(); i++) {
-            for (int j = 0; j < biases2.getM(); j++) {
-                biases2.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
-            }
+    }
+
+    int isolated = 0, doubled = 0, passed[8] = {};
+    for (int color = 0; color < 2; color++) {
+        int sign = color == WHITE ? 1 : -1;
+        uint64_t pawns = board.bitboards[color][PAWN - 1], their_pawns = board.bitboards[color ^ 1][PAWN - 1];
+
+        for (uint64_t remaining = pawns; remaining; remaining &= remaining - 1) {
+            int square = __builtin_ctzll(remaining), rank = square / 8;
+            uint64_t file = FILE_A << square % 8;
+            uint64_t neighbours = (file << 1 & ~FILE_A) | (file >> 1 & ~FILE_H);
+            uint64_t ahead = color == WHITE ? ~0ull << (rank * 8 + 8) : (1ull << rank * 8) - 1;
+
+            isolated += pawns & neighbours ? 0 : sign;
+            doubled += pawns & file & ~(1ull << square) ? sign : 0;
+            passed[color == WHITE ? rank : 7 - rank] += their_pawns & (file | neighbours) & ahead ? 0 : sign;
         }
-        for (int i = 0; i < biases3.getN(); i++) {
-            for (int j = 0; j < biases3.getM(); j++) {
-                biases3.at(i, j) = ((float)rand() / (float)RAND_MAX) * 2 - 1;
+    }
+    // both are penalties
+    if (isolated) {
+        features[len++] = {PARAM_INDEX(isolated_pawn), (float)-isolated};
+    }
+    if (doubled) {
+        features[len++] = {PARAM_INDEX(doubled_pawn), (float)-doubled};
+    }
+    for (int rank = 1; rank < 7; rank++) {
+        if (passed[rank]) {
+            features[len++] = {(uint16_t)(PARAM_INDEX(passed_pawn) + rank), (float)passed[rank]};
+        }
+    }
+
+    // at most one side can be ahead
+    for (int color = 0; color < 2; color++) {
+        if (material[color] > EVAL_MOPUP_MARGIN + material[color ^ 1]) {
+            int king = __builtin_ctzll(board.bitboards[color][KING - 1]);
+            int king2 = __builtin_ctzll(board.bitboards[color ^ 1][KING - 1]);
+            float weight = (color == WHITE ? 1.0f : -1.0f) * (float)(16 - non_pawns) / 16.0f;
+
+            features[len++] = {PARAM_INDEX(mopup_offset), weight};
+            features[len++] = {PARAM_INDEX(mopup_center), weight * (fabsf(king2 % 8 - 3.5f) + fabsf(king2 / 8 - 3.5f))};
+            features[len++] = {PARAM_INDEX(mopup_distance), -weight * (abs(king % 8 - king2 % 8) + abs(king / 8 - king2 / 8))};
+        }
+    }
+
+    assert(len <= MAX_EVAL_FEATURES);
+    return len;
+}
+
+// one pass over the indexed boards: returns the mean loss, overwrites gradient and the mean
+// absolute difference to Stockfish in centipawns
+double eval_loss(
+    const FileFormat* __restrict__ data,
+    const DatasetIndex* index,
+    const EvalParams& params,
+    double* __restrict__ gradient,
+    double* abs_error
+) {
+    const float* weights = (const float*)&params;
+    double loss = 0, error = 0;
+
+    memset(gradient, 0, NUM_EVAL_PARAMS * sizeof *gradient);
+
+#pragma omp parallel for schedule(static) reduction(+ : loss, error) reduction(+ : gradient[:NUM_EVAL_PARAMS])
+    for (size_t i = 0; i < index->num_indices; i++) {
+        const PreprocessedBoard& board = data->boards[index->indices[i]];
+        EvalFeature features[MAX_EVAL_FEATURES];
+        int len = eval_features(board, params, features);
+
+        float eval = 0;
+        for (int f = 0; f < len; f++) {
+            eval += weights[features[f].index] * features[f].value;
+        }
+
+        // lichess evals are from white's point of view
+        float target = (float)board.stockfish_eval;
+        float predicted = win_probability(eval), expected = win_probability(target);
+
+        loss += (predicted - expected) * (predicted - expected);
+        error += fabsf(eval - target);
+
+        float slope = 2.0f * (predicted - expected) * predicted * (1.0f - predicted) * EVAL_SIGMOID_SCALE;
+        for (int f = 0; f < len; f++) {
+            gradient[features[f].index] += slope * features[f].value;
+        }
+    }
+
+    for (int i = 0; i < NUM_EVAL_PARAMS; i++) {
+        gradient[i] /= (double)index->num_indices;
+    }
+    *abs_error = error / (double)index->num_indices;
+    return loss / (double)index->num_indices;
+}
+
+EvalParams eval_params_from_header() {
+    EvalParams params = {};
+    params.material[PAWN - 1] = EVAL_PAWN;
+    params.material[KNIGHT - 1] = EVAL_KNIGHT;
+    params.material[BISHOP - 1] = EVAL_BISHOP;
+    params.material[ROOK - 1] = EVAL_ROOK;
+    params.material[QUEEN - 1] = EVAL_QUEEN;
+    params.mopup_offset = EVAL_MOPUP_OFFSET;
+    params.mopup_center = EVAL_MOPUP_CENTER;
+    params.mopup_distance = EVAL_MOPUP_DISTANCE;
+    params.isolated_pawn = EVAL_ISOLATED_PAWN;
+    params.doubled_pawn = EVAL_DOUBLED_PAWN;
+
+    const int passed_pawn[8] = EVAL_PASSED_PAWN;
+    for (int rank = 0; rank < 8; rank++) {
+        params.passed_pawn[rank] = passed_pawn[rank];
+    }
+#ifdef EVAL_PST
+    const int pst[7][64] = EVAL_PST;
+    for (int piece = 0; piece < 6; piece++) {
+        for (int square = 0; square < 64; square++) {
+            params.pst[piece][square] = pst[piece + 1][square];
+        }
+    }
+#endif
+    return params;
+}
+
+void write_eval_params(const char* path, const EvalParams& params, bool write_pst) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "open failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "#pragma once\n\n");
+    fprintf(out, "// Evaluation weights in centipawns. train_nn tune_eval fits them to the Stockfish evals in\n");
+    fprintf(out, "// lichess_db_eval_processed.bin and writes this file back out, the engine and the static\n");
+    fprintf(out, "// eval in train_nn both read it.\n\n");
+
+    fprintf(out, "// material, indexed by PieceType\n");
+    fprintf(out, "#define EVAL_PAWN %ld\n", lroundf(params.material[PAWN - 1]));
+    fprintf(out, "#define EVAL_BISHOP %ld\n", lroundf(params.material[BISHOP - 1]));
+    fprintf(out, "#define EVAL_KNIGHT %ld\n", lroundf(params.material[KNIGHT - 1]));
+    fprintf(out, "#define EVAL_ROOK %ld\n", lroundf(params.material[ROOK - 1]));
+    fprintf(out, "#define EVAL_QUEEN %ld\n\n", lroundf(params.material[QUEEN - 1]));
+
+    fprintf(out, "// endgame king terms, only when one side is EVAL_MOPUP_MARGIN ahead in material:\n");
+    fprintf(out, "// (EVAL_MOPUP_OFFSET + their king's distance from the centre * EVAL_MOPUP_CENTER\n");
+    fprintf(out, "//  - distance between the kings * EVAL_MOPUP_DISTANCE) * endgame weight / 16\n");
+    fprintf(out, "#define EVAL_MOPUP_MARGIN %d\n", EVAL_MOPUP_MARGIN);
+    fprintf(out, "#define EVAL_MOPUP_OFFSET %ld\n", lroundf(params.mopup_offset));
+    fprintf(out, "#define EVAL_MOPUP_CENTER %ld\n", lroundf(params.mopup_center));
+    fprintf(out, "#define EVAL_MOPUP_DISTANCE %ld\n\n", lroundf(params.mopup_distance));
+
+    fprintf(out, "// pawn structure, passed pawns by rank as seen from the pawn's side\n");
+    fprintf(out, "#define EVAL_ISOLATED_PAWN %ld\n", lroundf(params.isolated_pawn));
+    fprintf(out, "#define EVAL_DOUBLED_PAWN %ld\n", lroundf(params.doubled_pawn));
+    fprintf(out, "#define EVAL_PASSED_PAWN {");
+    for (int rank = 0; rank < 8; rank++) {
+        fprintf(out, "%s%ld", rank ? ", " : "", lroundf(params.passed_pawn[rank]));
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "// piece-square tables indexed by PieceType and square from the piece's side (a1 is 0),\n");
+    fprintf(out, "// only defined when tune_eval --pst wrote them since they cost a lot of tokens\n");
+    if (!write_pst) {
+        fprintf(out, "// #define EVAL_PST {{...}, ...}\n");
+        fclose(out);
+        return;
+    }
+    fprintf(out, "#define EVAL_PST \\\n    { \\\n        {0}, \\\n");
+    for (int piece = 0; piece < 6; piece++) {
+        fprintf(out, "        { \\\n");
+        for (int rank = 0; rank < 8; rank++) {
+            fprintf(out, "           ");
+            for (int file = 0; file < 8; file++) {
+                fprintf(out, " %ld,", lroundf(params.pst[piece][rank * 8 + file]));
             }
+            fprintf(out, " \\\n");
         }
+        fprintf(out, "        }, \\\n");
+    }
+    fprintf(out, "    }\n");
 
-        constexpr int num_epochs = 1000;
-        constexpr int batch_size = 256;
-        constexpr float lr_decay = 0.95f;
+    fclose(out);
+}
 
-        constexpr int log_steps = 32;
+void tune_eval(int num_epochs, const char* out_path, bool tune_pst) {
+    const FileFormat* data = map_dataset(MADV_SEQUENTIAL);
+    // same positions as the net trains on, the index is in dataset order so the passes stay sequential
+    const DatasetIndex* index = map_index(data);
+    if (!index->num_indices) {
+        fprintf(stderr, "no boards passed the index filters\n");
+        exit(EXIT_FAILURE);
+    }
+
+    EvalParams params = eval_params_from_header();
+    float* weights = (float*)&params;
+
+    // without --pst the tables stay out of the header, so the other weights have to do without them
+    if (!tune_pst) {
+        memset(params.pst, 0, sizeof params.pst);
+    }
+
+    // Adam, the material weights and the pst entries differ by orders of magnitude in how
+    // often they show up, plain gradient descent would need a step size per group
+    constexpr float lr = 1.0f;
+    constexpr float beta1 = 0.9f, beta2 = 0.999f, epsilon = 1e-12f;
+    static double gradient[NUM_EVAL_PARAMS], momentum[NUM_EVAL_PARAMS], velocity[NUM_EVAL_PARAMS];
+
+    for (int epoch = 0; epoch < num_epochs; epoch++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        double abs_error;
+        double loss = eval_loss(data, index, params, gradient, &abs_error);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf(
+            "[Epoch %d] Loss: %.6f | Delta: ±%.2f | %.2fs\n",
+            epoch + 1,
+            loss,
+            abs_error,
+            (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9
+        );
+
+        if (!tune_pst) {
+            memset(gradient + PARAM_INDEX(pst), 0, sizeof params.pst / sizeof(float) * sizeof *gradient);
+        }
+
+        for (int i = 0; i < NUM_EVAL_PARAMS; i++) {
+            momentum[i] = beta1 * momentum[i] + (1 - beta1) * gradient[i];
+            velocity[i] = beta2 * velocity[i] + (1 - beta2) * gradient[i] * gradient[i];
 
-        FILE* gnuplot = popen(
+            double m = momentum[i] / (1 - pow(beta1, epoch + 1));
+            double v = velocity[i] / (1 - pow(beta2, epoch + 1));
+            weights[i] -= (float)(lr * m / (sqrt(v) + epsilon));
+        }
+
+        if ((epoch + 1) % 10 == 0 || epoch + 1 == num_epochs) {
+            write_eval_params(out_path, params, tune_pst);
+        }
+    }
+
+    printf("Wrote %s\n", out_path);
+}
+
+// Training metrics go through a queue to a writer thread, which prints them, appends them to
+// METRICS_PATH and feeds the live plot of train_nn live. Logging never waits on any of
+// that, when the writer falls behind the records are dropped and counted instead.
+
+#define METRICS_QUEUE_SIZE 256
+#define METRICS_PATH "train_nn_metrics.csv"
+
+typedef struct {
+    int epoch;
+    size_t position;
+    size_t num_boards;
+    int batches;
+    int batch_size;
+    float loss;        // summed over the batches
+    float diff;        // summed over the positions, in centipawns
+    float static_diff; // mean over the training set, in centipawns
+    // wall clock, and the time spent in each phase of the training step
+    double start, end;
+    double data_seconds, forward_seconds, backward_seconds, update_seconds;
+} MetricsRecord;
+
+static struct {
+    MetricsRecord queue[METRICS_QUEUE_SIZE];
+    // head is only written by the training loop, tail only by the writer
+    size_t head;
+    size_t tail;
+    bool stop;
+    size_t dropped;
+
+    pthread_t writer;
+    FILE* csv;
+    FILE* live;
+} metrics_state;
+
+double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+void write_metrics(const MetricsRecord& record) {
+    int samples = record.batches * record.batch_size;
+    double seconds = record.end - record.start;
+    float loss = record.loss / (float)record.batches;
+    float diff = record.diff / (float)samples;
+    float improvement = record.static_diff - diff;
+
+    printf(
+        "[Epoch %d] %zu/%zu (%.02f%%) | Loss: %.4f | Delta: ±%.4f | Static: ±%.4f | Improvement: %.4f | "
+        "%.0f pos/s (data %.0f%%, forward %.0f%%, backward %.0f%%, update %.0f%%)\n",
+        record.epoch,
+        record.position,
+        record.num_boards,
+        (float)record.position / (float)record.num_boards * 100.0f,
+        loss,
+        diff,
+        record.static_diff,
+        improvement,
+        samples / seconds,
+        record.data_seconds / seconds * 100,
+        record.forward_seconds / seconds * 100,
+        record.backward_seconds / seconds * 100,
+        record.update_seconds / seconds * 100
+    );
+
+    fprintf(
+        metrics_state.csv,
+        "%d,%zu,%f,%f,%f,%f,%f,%f,%f,%f,%f\n",
+        record.epoch,
+        record.position,
+        loss,
+        diff,
+        record.static_diff,
+        improvement,
+        samples / seconds,
+        record.data_seconds,
+        record.forward_seconds,
+        record.backward_seconds,
+        record.update_seconds
+    );
+    fflush(metrics_state.csv);
+
+    if (metrics_state.live) {
+        // the pipe doesn't block, a stalled plot loses lines instead of holding up the csv.
+        // writes up to PIPE_BUF go through whole or not at all
+        char line[128];
+        int len = snprintf(line, sizeof line, "%f %f %f\n", loss, diff, improvement);
+        if (write(fileno(metrics_state.live), line, len) < 0 && errno != EAGAIN) {
+            perror("write live plot");
+        }
+    }
+}
+
+void* metrics_writer(void*) {
+    for (;;) {
+        // stop first, everything queued before it was set is visible below
+        bool stop = __atomic_load_n(&metrics_state.stop, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&metrics_state.head, __ATOMIC_ACQUIRE);
+
+        if (metrics_state.tail == head) {
+            if (stop) {
+                return NULL;
+            }
+            struct timespec wait = {.tv_sec = 0, .tv_nsec = 10'000'000};
+            nanosleep(&wait, NULL);
+            continue;
+        }
+
+        write_metrics(metrics_state.queue[metrics_state.tail % METRICS_QUEUE_SIZE]);
+        __atomic_store_n(&metrics_state.tail, metrics_state.tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void start_metrics(bool live) {
+    metrics_state.csv = fopen(METRICS_PATH, "w");
+    if (!metrics_state.csv) {
+        fprintf(stderr, "open failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(
+        metrics_state.csv,
+        "epoch,position,loss,diff,static_diff,improvement,samples_per_second,data_seconds,forward_seconds,"
+        "backward_seconds,update_seconds\n"
+    );
+
+    if (live) {
+        metrics_state.live = popen(
             "feedgnuplot"
             " --stream"
             " --lines"
@@ -871,108 +2070,676 @@ int main(int argc, const char** argv) {
             " --legend 2 'Improvement from static eval'",
             "w"
         );
+        if (!metrics_state.live) {
+            perror("popen feedgnuplot");
+        }
+        else {
+            int fd = fileno(metrics_state.live);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
 
+    if (pthread_create(&metrics_state.writer, NULL, metrics_writer, NULL)) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
 
-        float lr = 0.001;
+// never blocks
+void log_metrics(const MetricsRecord& record) {
+    size_t head = metrics_state.head;
+    if (head - __atomic_load_n(&metrics_state.tail, __ATOMIC_ACQUIRE) == METRICS_QUEUE_SIZE) {
+        metrics_state.dropped++;
+        return;
+    }
 
-        for (int epoch = 0; epoch < num_epochs; epoch++) {
-            float epoch_loss = 0.0f;
-            float epoch_diff = 0.0f;
-            float epoch_static_diff = 0.0f;
+    metrics_state.queue[head % METRICS_QUEUE_SIZE] = record;
+    __atomic_store_n(&metrics_state.head, head + 1, __ATOMIC_RELEASE);
+}
+
+// writes out what's still queued
+void stop_metrics(void) {
+    __atomic_store_n(&metrics_state.stop, true, __ATOMIC_RELEASE);
+    pthread_join(metrics_state.writer, NULL);
+
+    fclose(metrics_state.csv);
+    metrics_state.csv = nullptr;
 
-            if (epoch == 0 && false) {
-                printf("Sorting\n");
-                qsort(all_boards->boards, all_boards->num_boards, sizeof(PreprocessedBoard), compareBoard);
+    if (metrics_state.dropped) {
+        printf("Dropped %zu metrics records, the writer fell behind\n", metrics_state.dropped);
+    }
+    printf("Wrote %s\n", METRICS_PATH);
+
+    if (metrics_state.live) {
+        // keeps the plot open
+        getchar();
+        pclose(metrics_state.live);
+        metrics_state.live = nullptr;
+    }
+}
+
+// the mean absolute difference between the static eval and Stockfish, the baseline the net
+// has to beat. it doesn't depend on the order, so once per dataset is enough
+float static_eval_baseline(const PreprocessedBoard* boards, const uint32_t* indices, size_t num_boards) {
+    double diff = 0;
+#pragma omp parallel for reduction(+ : diff)
+    for (size_t i = 0; i < num_boards; i++) {
+        const PreprocessedBoard& board = boards[indices[i]];
+        float unscaled_stockfish_eval = board.stockfish_eval * (board.is_white ? 1.0f : -1.0f);
+        diff += fabsf(unscaled_stockfish_eval - ask_static_eval(board));
+    }
+    return (float)(diff / (double)num_boards);
+}
+
+// Scores positions with a net saved by the training, FENs one per line or the format train_nn
+// preprocess writes. Reads stdin without a path or with -, prints one score per line in
+// centipawns for the side to move, with the Stockfish eval next to it for the binary format.
+// A FEN that doesn't parse gets a - instead of a score, so the output stays line for line.
+void evaluate_positions(const char* weights_path, const char* positions_path, bool binary) {
+    // the kernels split a batch across the cores
+    constexpr int batch_size = 1024;
+
+    Arena arena(
+        Net<batch_size>::inference_bytes + Tensor<batch_size, LAYER_1_PARAMS>::bytes + 2 * Net<batch_size>::scratch_bytes
+    );
+    Net<batch_size> net(arena, false);
+    load_weights(net, weights_path);
+#ifdef QAT
+    net.fake_quantize();
+#endif
+
+    Tensor<batch_size, LAYER_1_PARAMS> inputs(arena);
+    float* sums_scratch = arena.allocate(Net<batch_size>::scratch_bytes);
+    float* active_scratch = arena.allocate(Net<batch_size>::scratch_bytes);
+
+    bool from_stdin = !positions_path || !strcmp(positions_path, "-");
+    FILE* in = from_stdin ? stdin : fopen(positions_path, binary ? "rb" : "r");
+    size_t remaining = SIZE_MAX;
+    if (!in || (binary && fread(&remaining, sizeof remaining, 1, in) != 1)) {
+        fprintf(stderr, "reading %s failed %s\n", from_stdin ? "stdin" : positions_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    static PreprocessedBoard boards[batch_size];
+    static char fens[batch_size][256];
+    static bool valid[batch_size];
+
+    size_t num_positions = 0, num_invalid = 0;
+    double diff = 0;
+    double start = now_seconds();
+
+    for (;;) {
+        int len = 0;
+        if (binary) {
+            len = (int)fread(boards, sizeof *boards, remaining < batch_size ? remaining : batch_size, in);
+            remaining -= len;
+        }
+        else {
+            while (len < batch_size && fgets(fens[len], sizeof fens[len], in)) {
+                fens[len][strcspn(fens[len], "\r\n")] = '\0';
+                len += fens[len][0] != '\0';
+            }
+#pragma omp parallel for
+            for (int b = 0; b < len; b++) {
+                // an empty board in its place keeps the batch layout
+                valid[b] = preprocess_fen(fens[b], &boards[b]);
+                if (!valid[b]) {
+                    boards[b] = {};
+                }
+            }
+        }
+        if (len == 0) {
+            break;
+        }
+
+        // the rest of a short batch goes through as empty boards
+        memset(&boards[len], 0, (batch_size - len) * sizeof *boards);
+        input_as_matrix(boards, inputs);
+        Tensor<batch_size, Net<batch_size>::outputs> scores = net.infer(inputs, sums_scratch, active_scratch);
+
+        for (int b = 0; b < len; b++) {
+            float score = scores.at(b, 0) * 2000.0f;
+            if (!binary && !valid[b]) {
+                fprintf(stderr, "skipping invalid FEN %s\n", fens[b]);
+                printf("-\n");
+                num_invalid++;
+            }
+            else if (binary) {
+                float stockfish_eval = boards[b].stockfish_eval * (boards[b].is_white ? 1.0f : -1.0f);
+                diff += fabsf(score - stockfish_eval);
+                printf("%.0f\t%.0f\n", score, stockfish_eval);
             }
             else {
+                printf("%.0f\n", score);
+            }
+        }
+        num_positions += len;
+    }
+    num_positions -= num_invalid;
 
-                printf("Shuffling\n");
-                for (size_t i = all_boards->num_boards - 1; i > 0; i--) {
-                    size_t j = (size_t)rand() % (i + 1);
+    double seconds = now_seconds() - start;
+    fprintf(stderr, "Scored %zu positions in %.2fs, %.0f positions/s\n", num_positions, seconds, num_positions / seconds);
+    if (num_invalid) {
+        fprintf(stderr, "Skipped %zu invalid FENs\n", num_invalid);
+    }
+    if (binary && num_positions) {
+        fprintf(stderr, "Delta to Stockfish: ±%.2f\n", diff / (double)num_positions);
+    }
 
-                    PreprocessedBoard tmp = all_boards->boards[i];
-                    all_boards->boards[i] = all_boards->boards[j];
-                    all_boards->boards[j] = tmp;
-                }
+    if (!from_stdin) {
+        fclose(in);
+    }
+}
+
+// Trains several configurations at once in one process. They share the mapped dataset, the
+// index and its validation split, every run gets its own slice of the cores for the kernels
+// and stops once its loss on the held-out positions hasn't improved for a few epochs. The
+// topology and the batch size are template arguments, so the configurations are this table:
+// X(topology, batch size, lr, lr_decay)
+#define SWEEP_CONFIGS(X)            \
+    X(Net, 256, 0.001f, 0.95f)      \
+    X(Net, 256, 0.003f, 0.9f)       \
+    X(Net, 1024, 0.003f, 0.95f)     \
+    X(SmallNet, 256, 0.001f, 0.95f)
+
+#define SWEEP_PATH "train_nn_sweep.csv"
+// of the index, held out of every run's training
+#define SWEEP_VALIDATION_PERCENT 5
+// of every run's initial weights and shuffles
+#define SWEEP_SEED 1
+
+typedef struct {
+    const FileFormat* data;
+    // the shuffled index, the training positions and then the validation ones
+    const uint32_t* indices;
+    size_t training_boards;
+    size_t validation_boards;
+    int max_epochs;
+    int patience;
+} SweepData;
+
+typedef struct {
+    int epochs;
+    int best_epoch;
+    float best_loss;
+    float best_diff; // in centipawns
+    size_t positions;
+    double seconds;
+} SweepResult;
+
+typedef struct SweepConfig {
+    const char* topology;
+    int batch_size;
+    float lr;
+    float lr_decay;
+    void (*train)(const struct SweepConfig& config, const SweepData& shared, int id, SweepResult& result);
+} SweepConfig;
+
+// the mean l2 loss and the mean absolute difference in centipawns over the validation positions
+template <int batch_size, typename Model>
+void sweep_validate(
+    Model& net,
+    const SweepData& shared,
+    PreprocessedBoard* batch,
+    Tensor<batch_size, LAYER_1_PARAMS> inputs,
+    float* loss,
+    float* diff
+) {
+    const uint32_t* validation = shared.indices + shared.training_boards;
+    double squared = 0, absolute = 0;
+
+    for (size_t i = 0; i < shared.validation_boards; i += batch_size) {
+        int len = shared.validation_boards - i < (size_t)batch_size ? (int)(shared.validation_boards - i) : batch_size;
+        for (int j = 0; j < len; j++) {
+            batch[j] = shared.data->boards[validation[i + j]];
+        }
+        // the rest of a short batch goes through as empty boards and isn't counted
+        memset(&batch[len], 0, (batch_size - len) * sizeof *batch);
+        input_as_matrix(batch, inputs);
+
+        // the forward buffers are free until the next training step
+        Tensor<batch_size, Model::outputs> outputs = net.forward(inputs);
+        for (int j = 0; j < len; j++) {
+            float error = outputs.at(j, 0) - batch[j].stockfish_eval * (batch[j].is_white ? 1.0f : -1.0f) / 2000.0f;
+            squared += error * error;
+            absolute += fabsf(error);
+        }
+    }
+
+    *loss = (float)(squared / (double)shared.validation_boards);
+    *diff = (float)(absolute / (double)shared.validation_boards * 2000.0);
+}
+
+template <template <int> typename Topology, int batch_size>
+void sweep_train(const SweepConfig& config, const SweepData& shared, int id, SweepResult& result) {
+    using Model = Topology<batch_size>;
+
+    // allocated and first touched by the thread that trains it
+    Arena arena(
+        Model::arena_bytes + Tensor<batch_size, LAYER_1_PARAMS>::bytes + Tensor<batch_size, Model::outputs>::bytes
+    );
+    // the same seed for every run, runs of one topology start from the same weights and see
+    // the positions in the same order, so only the configuration tells them apart
+    unsigned int seed = SWEEP_SEED;
+
+    Model net(arena);
+    net.randomize(&seed);
+#ifdef QAT
+    net.fake_quantize();
+#endif
+
+    Tensor<batch_size, LAYER_1_PARAMS> inputs(arena);
+    Tensor<batch_size, Model::outputs> stockfish_eval(arena);
+    PreprocessedBoard* batch = (PreprocessedBoard*)malloc(batch_size * sizeof(PreprocessedBoard));
+
+    // every run shuffles its own copy of the training indices, at 4 bytes a position that's
+    // cheaper than making the faster runs wait for the slower ones at every epoch
+    uint32_t* order = (uint32_t*)malloc(shared.training_boards * sizeof(uint32_t));
+    memcpy(order, shared.indices, shared.training_boards * sizeof(uint32_t));
+
+    char weights_path[64];
+    snprintf(weights_path, sizeof weights_path, "nn_sweep_%d.bin", id);
+
+    result = {};
+    result.best_loss = INFINITY;
+    double start = now_seconds();
+    float lr = config.lr;
+
+    for (int epoch = 1; epoch <= shared.max_epochs && epoch - result.best_epoch <= shared.patience; epoch++) {
+        for (size_t i = shared.training_boards - 1; i > 0; i--) {
+            size_t j = (size_t)rand_r(&seed) % (i + 1);
+
+            uint32_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+
+        double epoch_start = now_seconds();
+        float loss = 0;
+        int batches = 0;
+        for (size_t i = 0; i + batch_size - 1 < shared.training_boards; i += batch_size) {
+            for (int j = 0; j < batch_size; j++) {
+                batch[j] = shared.data->boards[order[i + j]];
+                stockfish_eval.at(j, 0) = batch[j].stockfish_eval * (batch[j].is_white ? 1.0f : -1.0f);
+            }
+            matrix_multiply_scalar_inplace(stockfish_eval, 1.0f / 2000.0f);
+            input_as_matrix(batch, inputs);
+
+            Tensor<batch_size, Model::outputs> outputs = pass_forwards(net, inputs);
+            loss += matrix_l2_loss(outputs, stockfish_eval);
+            pass_backwards(net, outputs, stockfish_eval, inputs);
+
+            net.update(lr);
+#ifdef QAT
+            net.fake_quantize();
+#endif
+            batches++;
+        }
+        double seconds = now_seconds() - epoch_start;
+        result.positions += (size_t)batches * batch_size;
+
+        float validation_loss, validation_diff;
+        sweep_validate<batch_size>(net, shared, batch, inputs, &validation_loss, &validation_diff);
+
+        result.epochs = epoch;
+        bool improved = validation_loss < result.best_loss;
+        if (improved) {
+            result.best_epoch = epoch;
+            result.best_loss = validation_loss;
+            result.best_diff = validation_diff;
+            save_weights(net, weights_path);
+        }
+
+        printf(
+            "[Run %d %s/%d lr %g] Epoch %d | Loss: %.4f | Validation: %.4f ±%.2f%s | %.0f pos/s\n",
+            id,
+            config.topology,
+            batch_size,
+            config.lr,
+            epoch,
+            batches ? loss / (float)batches : 0.0f,
+            validation_loss,
+            validation_diff,
+            improved ? " (best)" : "",
+            batches * batch_size / seconds
+        );
+
+        lr *= config.lr_decay;
+    }
+
+    result.seconds = now_seconds() - start;
+    free(order);
+    free(batch);
+}
+
+void sweep(int max_epochs, int patience) {
+    static const SweepConfig configs[] = {
+#define SWEEP_CONFIG(TOPOLOGY, BATCH_SIZE, LR, LR_DECAY) \
+    {#TOPOLOGY, BATCH_SIZE, LR, LR_DECAY, sweep_train<TOPOLOGY, BATCH_SIZE>},
+        SWEEP_CONFIGS(SWEEP_CONFIG)
+#undef SWEEP_CONFIG
+    };
+    constexpr int num_runs = sizeof configs / sizeof *configs;
+
+    const FileFormat* all_boards = map_dataset(MADV_RANDOM);
+    DatasetIndex* index = map_index(all_boards);
+
+    // once, so every run holds out the same positions
+    for (size_t i = index->num_indices - 1; i > 0; i--) {
+        size_t j = (size_t)rand() % (i + 1);
+
+        uint32_t tmp = index->indices[i];
+        index->indices[i] = index->indices[j];
+        index->indices[j] = tmp;
+    }
+
+    SweepData shared;
+    shared.data = all_boards;
+    shared.indices = index->indices;
+    shared.validation_boards = index->num_indices * SWEEP_VALIDATION_PERCENT / 100;
+    shared.training_boards = index->num_indices - shared.validation_boards;
+    shared.max_epochs = max_epochs;
+    shared.patience = patience;
+    if (shared.validation_boards == 0) {
+        fprintf(stderr, "%zu positions are too few to hold any out\n", (size_t)index->num_indices);
+        exit(EXIT_FAILURE);
+    }
+
+    const float static_diff = static_eval_baseline(
+        all_boards->boards, index->indices + shared.training_boards, shared.validation_boards
+    );
+
+    // a run per thread of the outer team, the kernels' parallel regions inside it get its
+    // slice. with OMP_PROC_BIND=spread,close the slices stay on their own cores
+    int cores = omp_get_max_threads();
+    int concurrent = num_runs < cores ? num_runs : cores;
+    printf(
+        "Sweeping %d configurations, %d at a time on %d cores, validating on %zu positions\n",
+        num_runs,
+        concurrent,
+        cores,
+        shared.validation_boards
+    );
+    omp_set_max_active_levels(2);
+
+    SweepResult results[num_runs];
+#pragma omp parallel for schedule(dynamic, 1) num_threads(concurrent)
+    for (int r = 0; r < num_runs; r++) {
+        int thread = omp_get_thread_num();
+        omp_set_num_threads(cores / concurrent + (thread < cores % concurrent));
+        configs[r].train(configs[r], shared, r, results[r]);
+    }
+
+    FILE* csv = fopen(SWEEP_PATH, "w");
+    if (!csv) {
+        fprintf(stderr, "open failed %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(csv, "run,topology,batch_size,lr,lr_decay,epochs,best_epoch,validation_loss,validation_diff,seconds,samples_per_second\n");
+
+    int best = 0;
+    printf("\nStatic eval on the validation positions: ±%.2f\n", static_diff);
+    printf("run  topology  batch      lr  decay  epochs  best  val loss  val diff  seconds     pos/s\n");
+    for (int r = 0; r < num_runs; r++) {
+        const SweepConfig& config = configs[r];
+        const SweepResult& result = results[r];
+        double rate = result.positions / result.seconds;
+        best = result.best_loss < results[best].best_loss ? r : best;
+
+        printf(
+            "%3d  %-8s  %5d  %6g  %5g  %6d  %4d  %8.4f  %8.2f  %7.0f  %8.0f\n",
+            r,
+            config.topology,
+            config.batch_size,
+            config.lr,
+            config.lr_decay,
+            result.epochs,
+            result.best_epoch,
+            result.best_loss,
+            result.best_diff,
+            result.seconds,
+            rate
+        );
+        fprintf(
+            csv,
+            "%d,%s,%d,%f,%f,%d,%d,%f,%f,%f,%f\n",
+            r,
+            config.topology,
+            config.batch_size,
+            config.lr,
+            config.lr_decay,
+            result.epochs,
+            result.best_epoch,
+            result.best_loss,
+            result.best_diff,
+            result.seconds,
+            rate
+        );
+    }
+    fclose(csv);
+
+    printf("Best is run %d, its weights are in nn_sweep_%d.bin. Wrote %s\n", best, best, SWEEP_PATH);
+}
+
+int main(int argc, const char** argv) {
+    if (argc >= 2 && !strcmp(argv[1], "preprocess")) {
+        int fd = open("lichess_db_eval_processed.raw", O_RDONLY);
+        struct stat sb;
+        fstat(fd, &sb);
+        printf("Size: %lu\n", (uint64_t)sb.st_size);
+
+        const size_t fen_buffer_space = 5;
+
+        char* memblock = (char*)mmap(NULL, sb.st_size + fen_buffer_space, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (memblock == MAP_FAILED) {
+            fprintf(stderr, "mmap failed %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        memset(memblock + sb.st_size, ' ', fen_buffer_space);
+
+        memblock[sb.st_size + fen_buffer_space - 1] = '\0';
+
+        FILE* outfile = fopen("lichess_db_eval_processed.bin", "wb");
+        if (!outfile) {
+            fprintf(stderr, "open failed %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        // the count goes in front once it's known
+        FileFormat header = {.num_boards = 0};
+        fwrite(&header, sizeof header, 1, outfile);
+
+        header.num_boards = process_all_boards(memblock, outfile);
+
+        printf("Processing done\n");
+
+        if (fseek(outfile, 0, SEEK_SET) || fwrite(&header, sizeof header, 1, outfile) != 1 || fclose(outfile)) {
+            perror("write failed");
+            exit(EXIT_FAILURE);
+        }
+        printf("Wrote %lu boards, %lu bytes\n", header.num_boards, sizeof(FileFormat) + header.num_boards * sizeof(PreprocessedBoard));
+        printf("Done\n");
+    }
+    else if (argc >= 2 && !strcmp(argv[1], "tune_eval")) {
+        // train_nn tune_eval [--pst] [epochs] [header]
+        bool tune_pst = argc >= 3 && !strcmp(argv[2], "--pst");
+        int arg = 2 + tune_pst;
+        tune_eval(argc > arg ? atoi(argv[arg]) : 200, argc > arg + 1 ? argv[arg + 1] : "engine/eval_params.h", tune_pst);
+    }
+    else if (argc >= 2 && !strcmp(argv[1], "index")) {
+        // train_nn index [--min-depth n] [--max-eval cp] [--min-pieces n] [--max-pieces n] [--skip-in-check]
+        IndexFilters filters = DEFAULT_INDEX_FILTERS;
+        for (int i = 2; i < argc; i++) {
+            const char* value = i + 1 < argc ? argv[i + 1] : "";
+            if (!strcmp(argv[i], "--skip-in-check")) {
+                filters.skip_in_check = true;
+                continue;
+            }
+
+            if (!strcmp(argv[i], "--min-depth")) {
+                filters.min_depth = atoi(value);
+            }
+            else if (!strcmp(argv[i], "--max-eval")) {
+                filters.max_eval = atoi(value);
+            }
+            else if (!strcmp(argv[i], "--min-pieces")) {
+                filters.min_pieces = atoi(value);
+            }
+            else if (!strcmp(argv[i], "--max-pieces")) {
+                filters.max_pieces = atoi(value);
+            }
+            else {
+                fprintf(stderr, "unknown option %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        }
+        build_index(filters, INDEX_PATH);
+    }
+    else if (argc >= 2 && !strcmp(argv[1], "sweep")) {
+        // train_nn sweep [max epochs] [patience], the configurations are SWEEP_CONFIGS
+        sweep(argc >= 3 ? atoi(argv[2]) : 100, argc >= 4 ? atoi(argv[3]) : 3);
+    }
+    else if (argc >= 2 && !strcmp(argv[1], "eval")) {
+        // train_nn eval [weights] [positions or -] [fen|bin], bin by default for .bin files
+        const char* positions_path = argc >= 4 ? argv[3] : nullptr;
+        size_t path_len = positions_path ? strlen(positions_path) : 0;
+        bool binary = argc >= 5 ? !strcmp(argv[4], "bin") : path_len >= 4 && !strcmp(positions_path + path_len - 4, ".bin");
+        evaluate_positions(argc >= 3 ? argv[2] : "nn_weights.bin", positions_path, binary);
+    }
+    else {
+        // shuffled, readahead would only read boards nobody asked for
+        const FileFormat* all_boards = map_dataset(MADV_RANDOM);
+        DatasetIndex* index = map_index(all_boards);
+
+        // decompress_weights(compressed_weights);
+
+        constexpr int batch_size = 256;
+
+        // parameters and every buffer of the training step
+        Arena arena(
+            Net<batch_size>::arena_bytes + Tensor<batch_size, LAYER_1_PARAMS>::bytes
+            + Tensor<batch_size, Net<batch_size>::outputs>::bytes
+        );
+        Net<batch_size> net(arena);
+        unsigned int seed = 1;
+        net.randomize(&seed);
+
+        Tensor<batch_size, LAYER_1_PARAMS> inputs(arena);
+        Tensor<batch_size, Net<batch_size>::outputs> stockfish_eval(arena);
+        // gathered through the index
+        PreprocessedBoard batch[batch_size];
+
+        constexpr int num_epochs = 1000;
+        constexpr float lr_decay = 0.95f;
+
+        constexpr int log_steps = 32;
+
+#ifdef QAT
+        // the tail of the index is held out to compare the quantized net with the float one,
+        // at most a tenth of it for small or heavily filtered indices
+        const size_t validation_boards = index->num_indices / 10 < 16384 ? index->num_indices / 10 : 16384;
+        static Net<batch_size>::Quantized quantized_net;
+#else
+        constexpr size_t validation_boards = 0;
+#endif
+        const size_t training_boards = index->num_indices - validation_boards;
+        if (training_boards < batch_size) {
+            fprintf(stderr, "%zu positions are too few for a batch\n", (size_t)index->num_indices);
+            exit(EXIT_FAILURE);
+        }
+
+#ifdef QAT
+        PreprocessedBoard* validation = (PreprocessedBoard*)malloc(validation_boards * sizeof(PreprocessedBoard));
+        for (size_t i = 0; i < validation_boards; i++) {
+            validation[i] = all_boards->boards[index->indices[training_boards + i]];
+        }
+#endif
+
+        const float static_diff = static_eval_baseline(all_boards->boards, index->indices, training_boards);
+        printf("Static eval baseline: ±%.4f\n", static_diff);
+
+        // train_nn live also plots the progress
+        start_metrics(argc >= 2 && !strcmp(argv[1], "live"));
+
+        float lr = 0.001;
+
+#ifdef QAT
+        // the rounded copies are refreshed after every update
+        net.fake_quantize();
+#endif
+
+        for (int epoch = 0; epoch < num_epochs; epoch++) {
+            MetricsRecord window = {};
+            window.start = now_seconds();
+
+            printf("Shuffling\n");
+            for (size_t i = training_boards - 1; i > 0; i--) {
+                size_t j = (size_t)rand() % (i + 1);
+
+                uint32_t tmp = index->indices[i];
+                index->indices[i] = index->indices[j];
+                index->indices[j] = tmp;
             }
 
 
             printf("Training\n");
-            for (size_t i = 0; i + batch_size - 1 < all_boards->num_boards; i += batch_size) {
-                static Matrix<batch_size, LAYER_5_PARAMS> stockfish_eval;
+            for (size_t i = 0; i + batch_size - 1 < training_boards; i += batch_size) {
+                double data_start = now_seconds();
+
+                gather_batch(all_boards, &index->indices[i], batch, batch_size);
                 for (int j = 0; j < batch_size; j++) {
-                    stockfish_eval.at(j, 0) = all_boards->boards[i + j].stockfish_eval
-                                            * (all_boards->boards[i + j].is_white ? 1.0f : -1.0f);
+                    stockfish_eval.at(j, 0) = batch[j].stockfish_eval * (batch[j].is_white ? 1.0f : -1.0f);
                 }
                 matrix_multiply_scalar_inplace(stockfish_eval, 1.0f / 2000.0f);
 
-                static Matrix<batch_size, LAYER_1_PARAMS> inputs;
-                input_as_matrix(&all_boards->boards[i], inputs);
+                input_as_matrix(batch, inputs);
 
-                static Matrix<batch_size, LAYER_5_PARAMS> outputs;
+                double forward_start = now_seconds();
 
-                static Matrix<batch_size, LAYER_2_PARAMS> unactive_out1;
-                static Matrix<batch_size, LAYER_3_PARAMS> unactive_out2;
-                static Matrix<batch_size, LAYER_4_PARAMS> unactive_out3;
-                static Matrix<batch_size, LAYER_5_PARAMS> unactive_out4;
-                static Matrix<batch_size, LAYER_2_PARAMS> active_out1;
-                static Matrix<batch_size, LAYER_3_PARAMS> active_out2;
-                static Matrix<batch_size, LAYER_4_PARAMS> active_out3;
-                static Matrix<batch_size, LAYER_5_PARAMS> active_out4;
+                Tensor<batch_size, Net<batch_size>::outputs> outputs = pass_forwards(net, inputs);
+                window.loss += matrix_l2_loss(outputs, stockfish_eval);
+                window.diff += matrix_l1_loss(outputs, stockfish_eval) * 2000.0f * batch_size;
 
-                pass_forwards(inputs, outputs, unactive_out1, unactive_out2, unactive_out3, unactive_out4, active_out1, active_out2, active_out3, active_out4);
-                epoch_loss += matrix_l2_loss(outputs, stockfish_eval);
+                double backward_start = now_seconds();
 
-                pass_backwards(lr, outputs, stockfish_eval, inputs, unactive_out1, unactive_out2, unactive_out3, unactive_out4, active_out1, active_out2, active_out3);
+                pass_backwards(net, outputs, stockfish_eval, inputs);
 
+                double update_start = now_seconds();
 
-                for (int b = 0; b < batch_size; b++) {
-                    float static_eval = ask_static_eval(all_boards->boards[i + b]);
-                    float unscaled_stockfish_eval = all_boards->boards[i + b].stockfish_eval
-                                                  * (all_boards->boards[i + b].is_white ? 1.0f : -1.0f);
+                net.update(lr);
+#ifdef QAT
+                net.fake_quantize();
+#endif
 
-                    epoch_diff += fabsf(unscaled_stockfish_eval - outputs.at(b, 0) * 2000.0f);
-                    epoch_static_diff += fabsf(unscaled_stockfish_eval - static_eval);
-                }
+                double update_end = now_seconds();
+                window.batches++;
+                window.data_seconds += forward_start - data_start;
+                window.forward_seconds += backward_start - forward_start;
+                window.backward_seconds += update_start - backward_start;
+                window.update_seconds += update_end - update_start;
 
-                if (epoch == 0 && i > all_boards->num_boards / 2) {
+                if (epoch == 0 && i > index->num_indices / 2) {
                     break;
                 }
 
                 if (epoch == 0 && i < batch_size * log_steps * 10) {
-                    epoch_loss = 0;
-                    epoch_diff = 0;
-                    epoch_static_diff = 0;
+                    window = {};
+                    window.start = update_end;
                 }
 
                 if ((i + batch_size) % (log_steps * batch_size) == 0 && (epoch != 0 || i > batch_size * log_steps * 10)) {
-                    printf(
-                        "[Epoch %d] %zu/%lu (%.02f%%) | Loss: %.4f | Delta: ±%.4f | Static: ±%.4f| "
-                        "improvement: %.4f\n",
-                        epoch + 1,
-                        i + batch_size,
-                        all_boards->num_boards,
-                        (float)(i + batch_size) / (float)all_boards->num_boards * 100.0f,
-                        epoch_loss / (float)(log_steps),
-                        epoch_diff / (float)(log_steps * batch_size),
-                        epoch_static_diff / (float)(log_steps * batch_size),
-                        (epoch_static_diff - epoch_diff) / (float)(log_steps * batch_size)
-                    );
-
-                    if ((i + batch_size) / batch_size > 5) {
-                        fprintf(
-                            gnuplot,
-                            "%f %f %f\n",
-                            epoch_loss / (float)(log_steps),
-                            epoch_diff / (float)(log_steps * batch_size),
-                            (epoch_static_diff - epoch_diff) / (float)(log_steps * batch_size)
-                        );
-                        fflush(gnuplot);
-                    }
-
-                    epoch_loss = 0;
-                    epoch_diff = 0;
-                    epoch_static_diff = 0;
+                    window.epoch = epoch + 1;
+                    window.position = i + batch_size;
+                    window.num_boards = index->num_indices;
+                    window.batch_size = batch_size;
+                    window.static_diff = static_diff;
+                    window.end = update_end;
+                    log_metrics(window);
+
+                    window = {};
+                    window.start = update_end;
                 }
                 /*
                 if ((i + 1) % batch_size == 0) {
@@ -987,16 +2754,22 @@ int main(int argc, const char** argv) {
                 */
             }
 
-            float avg_loss = epoch_loss / (float)all_boards->num_boards;
+            float avg_loss = window.loss / (float)index->num_indices;
             printf("Epoch %d complete. Average loss: %.4f\n", epoch + 1, avg_loss);
+            save_weights(net, "nn_weights.bin");
+
+#ifdef QAT
+            quantized_net.quantize(net);
+            validate_quantized(net, quantized_net, validation, validation_boards);
+            save_quantized(quantized_net, "nn_quantized.bin");
+#endif
 
             lr *= lr_decay;
         }
 
         printf("Done training\n");
 
-        getchar();
-        pclose(gnuplot);
+        stop_metrics();
     }
 
     exit(0);
@@ -0,0 +1,133 @@
+import argparse
+import os
+import random
+import re
+import subprocess
+from dataclasses import dataclass
+
+# SPSA tuning of the constants in engine/search_params.h.
+#
+# Every iteration nudges all parameters at once in a random direction, plays a batch of
+# games between theta + c * delta and theta - c * delta and steps theta towards whichever
+# side won. The games go through cutechess-cli with the -DTUNE UCI build, which takes the
+# parameters as options, so a batch keeps every core busy.
+#
+# usage: python resources/spsa.py --iterations 500
+# (build/bin/thera_mini_tune and build/tools/UHO_Lichess_4852_v1.epd have to exist, see the Makefile)
+
+PARAMS_HEADER = "engine/search_params.h"
+
+
+@dataclass
+class Param:
+    name: str
+    value: float
+    min: int
+    max: int
+
+    # Fishtest-style schedule: c_end is the perturbation size at the last iteration,
+    # r_end the learning rate relative to it
+    @property
+    def c_end(self):
+        return max((self.max - self.min) / 20, 1)
+
+    def clamp(self, value):
+        return min(max(value, self.min), self.max)
+
+
+def read_params(path):
+    text = open(path).read()
+    values = {name: float(value) for name, value in re.findall(r"#define (\w+) (-?\d+)\n", text)}
+    return [
+        Param(name, values[name], int(low), int(high))
+        for name, low, high in re.findall(r"X\((\w+), (-?\d+), (-?\d+)\)", text)
+    ]
+
+
+def write_params(path, params):
+    text = open(path).read()
+    for param in params:
+        text = re.sub(rf"#define {param.name} -?\d+\n", f"#define {param.name} {round(param.value)}\n", text)
+    open(path, "w").write(text)
+
+
+def play_games(args, plus, minus):
+    """plays a batch between the two parameter sets, returns (wins, losses, draws) of plus"""
+
+    def engine(name, values):
+        return ["-engine", f"name={name}", f"cmd={args.engine}"] + [
+            f"option.{param}={value}" for param, value in values.items()
+        ]
+
+    command = (
+        ["cutechess-cli"]
+        + engine("plus", plus)
+        + engine("minus", minus)
+        + ["-each", f"tc={args.tc}", "timemargin=200", "proto=uci"]
+        + ["-openings", f"file={args.openings}", "format=epd", "order=random", "policy=round"]
+        # pairs with colors swapped, so the opening itself cancels out
+        + ["-games", "2", "-rounds", str(args.games // 2), "-repeat"]
+        + ["-concurrency", str(args.concurrency), "-recover"]
+        + ["-srand", str(random.getrandbits(31))]
+    )
+    output = subprocess.run(command, capture_output=True, text=True).stdout
+
+    scores = re.findall(r"Score of plus vs minus: (\d+) - (\d+) - (\d+)", output)
+    if not scores:
+        raise RuntimeError("cutechess-cli reported no result:\n" + output)
+    return tuple(map(int, scores[-1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="SPSA tuning of the search constants")
+    parser.add_argument("--engine", default="build/bin/thera_mini_tune")
+    parser.add_argument("--openings", default="build/tools/UHO_Lichess_4852_v1.epd")
+    parser.add_argument("--header", default=PARAMS_HEADER)
+    parser.add_argument("--iterations", type=int, default=200)
+    parser.add_argument("--games", type=int, default=2 * (os.cpu_count() or 1), help="games per iteration")
+    parser.add_argument("--concurrency", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--tc", default="1+0.01")
+    parser.add_argument("--r-end", type=float, default=0.002)
+    parser.add_argument("--save-every", type=int, default=10, help="iterations between header rewrites")
+    args = parser.parse_args()
+    args.games += args.games % 2
+
+    params = read_params(args.header)
+    if not params:
+        raise SystemExit(f"no parameters found in {args.header}")
+
+    # standard SPSA exponents
+    alpha, gamma = 0.602, 0.101
+    big_a = 0.1 * args.iterations
+
+    total = [0, 0, 0]
+    for k in range(args.iterations):
+        deltas = [random.choice((-1, 1)) for _ in params]
+        cs = [p.c_end * args.iterations**gamma / (k + 1) ** gamma for p in params]
+
+        plus = {p.name: round(p.clamp(p.value + c * d)) for p, c, d in zip(params, cs, deltas)}
+        minus = {p.name: round(p.clamp(p.value - c * d)) for p, c, d in zip(params, cs, deltas)}
+
+        wins, losses, draws = play_games(args, plus, minus)
+        total = [total[0] + wins, total[1] + losses, total[2] + draws]
+
+        for p, c, d in zip(params, cs, deltas):
+            a = args.r_end * p.c_end**2 * (big_a + args.iterations) ** alpha
+            step = a / (k + 1 + big_a) ** alpha
+            p.value = p.clamp(p.value + step * (wins - losses) / (c * d))
+
+        print(
+            f"iteration {k + 1}/{args.iterations}: +{wins} -{losses} ={draws} "
+            + " ".join(f"{p.name}={p.value:.1f}" for p in params),
+            flush=True,
+        )
+        if (k + 1) % args.save_every == 0 or k + 1 == args.iterations:
+            write_params(args.header, params)
+
+    games = sum(total)
+    print(f"{games} games, plus scored {(total[0] + total[2] / 2) / max(games, 1) * 100:.1f}%")
+    print(f"wrote {args.header}, rebuild and check with make test before keeping it")
+
+
+if __name__ == "__main__":
+    main()